@@ -0,0 +1,332 @@
+// Load test over loopback: starts a WebServer in this process, drives it
+// with many client connections for a while, and reports the throughput and
+// latency percentiles seen by the clients. Run with --help for the options.
+
+#include "critter/webserver.h"
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+namespace detail = critter::detail;
+namespace http = boost::beast::http;
+namespace websocket = boost::beast::websocket;
+namespace ssl = boost::asio::ssl;
+using tcp = boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+    unsigned connections = 64;
+    double duration = 10;           // seconds
+    unsigned pipeline = 1;          // requests written at once on a connection
+    bool keep_alive = true;
+    bool tls = false;
+    bool websocket = false;
+    unsigned ws_rate = 0;           // messages per second per connection, 0 for back to back
+    std::size_t body_size = 16;     // of responses and WebSocket messages
+    unsigned server_threads = 1;
+    unsigned client_threads = 1;
+    unsigned short port = 18080;
+    std::string certificate = CRITTER_CERTIFICATE_DIR "/cert.pem";
+    std::string key = CRITTER_CERTIFICATE_DIR "/key.pem";
+};
+
+// What one connection measured; merged once the clients are done.
+struct Results
+{
+    std::vector<std::uint64_t> latencies;   // microseconds
+    std::uint64_t errors = 0;
+};
+
+std::uint64_t microseconds_since(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+template<class Stream>
+Stream make_stream(boost::asio::io_context& ioc, ssl::context& ctx)
+{
+    if constexpr (std::is_same_v<Stream, tcp::socket>)
+        return Stream(ioc);
+    else
+        return Stream(ioc, ctx);
+}
+
+// Connects `stream`, with a TLS handshake when it is an ssl_stream.
+template<class Stream>
+detail::Task connect(Stream& stream, const Options& options, detail::Yield yield, boost::system::error_code& ec)
+{
+    tcp::endpoint const endpoint(boost::asio::ip::make_address("127.0.0.1"), options.port);
+    CRITTER_AWAIT boost::beast::get_lowest_layer(stream).async_connect(endpoint, yield[ec]);
+    if(ec) CRITTER_CO_RETURN;
+    boost::beast::get_lowest_layer(stream).set_option(tcp::no_delay(true));
+    if constexpr (!std::is_same_v<Stream, tcp::socket>)
+        CRITTER_AWAIT stream.async_handshake(ssl::stream_base::client, yield[ec]);
+}
+
+// Writes `pipeline` requests at once and reads their responses, over and
+// over; the latency of a request runs from the write to its response.
+template<class Stream>
+detail::Task http_client(boost::asio::io_context& ioc, ssl::context& ctx, const Options& options,
+                         const std::atomic<bool>& stop, Results& results, detail::Yield yield)
+{
+    std::string request;
+    for(unsigned i = 0; i < options.pipeline; ++i)
+        request += options.keep_alive ? "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                                      : "GET /hello HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+
+    boost::system::error_code ec;
+    while(!stop)
+    {
+        auto stream = make_stream<Stream>(ioc, ctx);
+        CRITTER_AWAIT connect(stream, options, yield, ec);
+        boost::beast::flat_buffer buffer;
+        while(!ec && !stop)
+        {
+            auto const sent = Clock::now();
+            CRITTER_AWAIT boost::asio::async_write(stream, boost::asio::buffer(request), yield[ec]);
+            for(unsigned i = 0; i < options.pipeline && !ec; ++i)
+            {
+                http::response<http::string_body> res;
+                CRITTER_AWAIT http::async_read(stream, buffer, res, yield[ec]);
+                if(!ec && res.result() == http::status::ok)
+                    results.latencies.push_back(microseconds_since(sent));
+                else if(!ec)
+                    ++results.errors;
+            }
+            if(!options.keep_alive)
+                break;
+        }
+        if(ec)
+        {
+            ++results.errors;
+            ec = {};
+        }
+        else if constexpr (!std::is_same_v<Stream, tcp::socket>)
+        {
+            CRITTER_AWAIT stream.async_shutdown(yield[ec]);
+            ec = {};
+        }
+    }
+}
+
+// Sends messages to the echo route and waits for each to come back, at
+// `ws_rate` messages per second when set; the latency is the round trip.
+template<class Stream>
+detail::Task ws_client(boost::asio::io_context& ioc, ssl::context& ctx, const Options& options,
+                       const std::atomic<bool>& stop, Results& results, detail::Yield yield)
+{
+    boost::system::error_code ec;
+    websocket::stream<Stream> ws(make_stream<Stream>(ioc, ctx));
+    CRITTER_AWAIT connect(ws.next_layer(), options, yield, ec);
+    if(!ec)
+        CRITTER_AWAIT ws.async_handshake("localhost", "/echo", yield[ec]);
+    if(ec)
+    {
+        ++results.errors;
+        CRITTER_CO_RETURN;
+    }
+
+    std::string const message(options.body_size, 'x');
+    boost::beast::flat_buffer buffer;
+    boost::asio::steady_timer timer(ioc);
+    auto const interval = options.ws_rate ? std::chrono::nanoseconds(std::chrono::seconds(1)) / options.ws_rate
+                                          : std::chrono::nanoseconds(0);
+    auto next = Clock::now();
+    while(!stop)
+    {
+        if(options.ws_rate)
+        {
+            next += interval;
+            timer.expires_at(next);
+            CRITTER_AWAIT timer.async_wait(yield[ec]);
+        }
+        auto const sent = Clock::now();
+        CRITTER_AWAIT ws.async_write(boost::asio::buffer(message), yield[ec]);
+        if(!ec)
+            CRITTER_AWAIT ws.async_read(buffer, yield[ec]);
+        if(ec)
+        {
+            ++results.errors;
+            CRITTER_CO_RETURN;
+        }
+        buffer.consume(buffer.size());
+        results.latencies.push_back(microseconds_since(sent));
+    }
+    CRITTER_AWAIT ws.async_close(websocket::close_code::normal, yield[ec]);
+}
+
+void usage()
+{
+    std::cout <<
+        "usage: loadtest [options]\n"
+        "  --connections N     client connections (64)\n"
+        "  --duration S        seconds to run (10)\n"
+        "  --pipeline N        requests written at once per connection (1)\n"
+        "  --no-keep-alive     one request per connection\n"
+        "  --tls               connect with TLS\n"
+        "  --ws                send WebSocket messages instead of HTTP requests\n"
+        "  --ws-rate N         WebSocket messages per second per connection, 0 for back to back (0)\n"
+        "  --body-size N       bytes of responses and messages (16)\n"
+        "  --server-threads N  threads running the server (1)\n"
+        "  --client-threads N  threads running the clients (1)\n"
+        "  --port N            port to listen on (18080)\n"
+        "  --cert FILE         certificate for --tls (example/cert.pem)\n"
+        "  --key FILE          private key for --tls (example/key.pem)\n";
+}
+
+Options parse(int argc, const char** argv)
+{
+    Options options;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string_view const arg = argv[i];
+        auto const value = [&]() -> std::string {
+            if(i + 1 == argc)
+                throw std::invalid_argument(std::string(arg) + " needs a value");
+            return argv[++i];
+        };
+        if(arg == "--connections") options.connections = std::stoul(value());
+        else if(arg == "--duration") options.duration = std::stod(value());
+        else if(arg == "--pipeline") options.pipeline = std::max(1ul, std::stoul(value()));
+        else if(arg == "--no-keep-alive") options.keep_alive = false;
+        else if(arg == "--tls") options.tls = true;
+        else if(arg == "--ws") options.websocket = true;
+        else if(arg == "--ws-rate") options.ws_rate = std::stoul(value());
+        else if(arg == "--body-size") options.body_size = std::stoul(value());
+        else if(arg == "--server-threads") options.server_threads = std::max(1ul, std::stoul(value()));
+        else if(arg == "--client-threads") options.client_threads = std::max(1ul, std::stoul(value()));
+        else if(arg == "--port") options.port = static_cast<unsigned short>(std::stoul(value()));
+        else if(arg == "--cert") options.certificate = value();
+        else if(arg == "--key") options.key = value();
+        else throw std::invalid_argument("unknown option " + std::string(arg));
+    }
+    if(!options.keep_alive)
+        options.pipeline = 1;
+    return options;
+}
+
+// Waits for the server's listener to accept connections.
+bool wait_for_listener(const Options& options)
+{
+    boost::asio::io_context ioc;
+    tcp::endpoint const endpoint(boost::asio::ip::make_address("127.0.0.1"), options.port);
+    for(int attempt = 0; attempt < 500; ++attempt)
+    {
+        tcp::socket socket(ioc);
+        boost::system::error_code ec;
+        socket.connect(endpoint, ec);
+        if(!ec)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+template<class Stream>
+void spawn_clients(const detail::Spawner& spawn, boost::asio::io_context& ioc, ssl::context& ctx,
+                   const Options& options, const std::atomic<bool>& stop, std::vector<Results>& results)
+{
+    for(auto& result: results)
+    {
+        spawn(ioc.get_executor(), [&](auto yield) {
+            return options.websocket ? ws_client<Stream>(ioc, ctx, options, stop, result, yield)
+                                     : http_client<Stream>(ioc, ctx, options, stop, result, yield);
+        });
+    }
+}
+
+}
+
+int main(int argc, const char** argv)
+{
+    Options options;
+    try {
+        if(argc > 1 && std::string_view(argv[1]) == "--help")
+            return usage(), 0;
+        options = parse(argc, argv);
+    } catch(const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        usage();
+        return 1;
+    }
+
+    critter::WebServer server;
+    if(options.tls)
+        server.listen(critter::SslOptions{options.certificate, options.key}, options.port);
+    else
+        server.listen(options.port);
+    server.add_http_handler(http::verb::get, "/hello", [body = std::string(options.body_size, 'x')](auto&&) {
+        return body;
+    });
+    server.add_ws_handler("/echo", [](auto msg, auto& session) {
+        session.send(msg);
+    });
+    server.start(options.server_threads);
+    if(!wait_for_listener(options))
+    {
+        std::cerr << "the server is not listening on port " << options.port << "\n";
+        return 1;
+    }
+
+    boost::asio::io_context ioc;
+    ssl::context ctx{ssl::context::tlsv12_client};
+    ctx.set_verify_mode(ssl::verify_none);
+    std::atomic<bool> stop{false};
+    std::vector<Results> results(options.connections);
+    detail::Spawner spawn;
+    if(options.tls)
+        spawn_clients<boost::beast::ssl_stream<tcp::socket>>(spawn, ioc, ctx, options, stop, results);
+    else
+        spawn_clients<tcp::socket>(spawn, ioc, ctx, options, stop, results);
+
+    boost::asio::steady_timer timer(ioc, std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.duration)));
+    timer.async_wait([&](boost::system::error_code) { stop = true; });
+
+    auto const start = Clock::now();
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < options.client_threads; ++i)
+        threads.emplace_back([&] { ioc.run(); });
+    ioc.run();
+    for(auto& thread: threads)
+        thread.join();
+    auto const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<std::uint64_t> latencies;
+    std::uint64_t errors = 0;
+    for(auto& result: results)
+    {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        errors += result.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto const percentile = [&](double q) -> double {
+        if(latencies.empty())
+            return 0;
+        auto const rank = std::min(latencies.size() - 1, static_cast<std::size_t>(q * latencies.size()));
+        return latencies[rank] / 1000.0;
+    };
+
+    std::printf("%s%s, %u connections, pipeline %u, %u server and %u client threads\n",
+        options.websocket ? "WebSocket" : "HTTP", options.tls ? " over TLS" : "", options.connections,
+        options.pipeline, options.server_threads, options.client_threads);
+    std::printf("%zu %s in %.2fs: %.0f/s, %llu errors\n", latencies.size(),
+        options.websocket ? "messages" : "requests", elapsed, latencies.size() / elapsed,
+        static_cast<unsigned long long>(errors));
+    std::printf("latency ms: p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+        percentile(0.5), percentile(0.99), percentile(0.999), latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+    return 0;
+}
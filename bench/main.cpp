@@ -0,0 +1,119 @@
+#include "critter/webserver.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <fstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace
+{
+
+using critter::Request;
+using critter::Response;
+namespace detail = critter::detail;
+
+// Routes /api/r<i>/items/{id}, looked up for the last one registered.
+void registry_get(benchmark::State& state)
+{
+    auto const count = state.range(0);
+    detail::Registry registry;
+    for(std::int64_t i = 0; i < count; ++i)
+    {
+        registry.add(http::verb::get, "/api/r" + std::to_string(i) + "/items/{id}",
+            detail::HttpHandler([](Request&&, const critter::PathParams&) { return Response(); }));
+    }
+    auto const target = "/api/r" + std::to_string(count - 1) + "/items/42";
+    for(auto _: state)
+        benchmark::DoNotOptimize(&registry.get(http::verb::get, target));
+}
+BENCHMARK(registry_get)->Arg(10)->Arg(100)->Arg(1000);
+
+void make_response_string(benchmark::State& state)
+{
+    std::string const body(state.range(0), 'x');
+    for(auto _: state)
+        benchmark::DoNotOptimize(detail::make_response(body));
+}
+BENCHMARK(make_response_string)->Arg(16)->Arg(16 * 1024);
+
+void make_response_literal(benchmark::State& state)
+{
+    for(auto _: state)
+        benchmark::DoNotOptimize(detail::make_response("Hello\n"));
+}
+BENCHMARK(make_response_literal);
+
+void make_response_moved(benchmark::State& state)
+{
+    for(auto _: state)
+    {
+        Response res{http::status::ok, 11};
+        res.body() = "Hello\n";
+        benchmark::DoNotOptimize(detail::make_response(std::move(res)));
+    }
+}
+BENCHMARK(make_response_moved);
+
+void mime_type(benchmark::State& state)
+{
+    static const char* const paths[] = {"/index.html", "/app.js", "/logo.svgz", "/photo.JPEG", "/archive.tar"};
+    std::size_t i = 0;
+    for(auto _: state)
+        benchmark::DoNotOptimize(detail::mime_type(paths[i++ % 5]));
+}
+BENCHMARK(mime_type);
+
+void path_cat(benchmark::State& state)
+{
+    for(auto _: state)
+        benchmark::DoNotOptimize(detail::path_cat("/var/www/", "/static/css/site.css"));
+}
+BENCHMARK(path_cat);
+
+// A document root holding a small and a large file, removed on exit.
+class DocRoot
+{
+public:
+    DocRoot()
+    {
+        char dir[] = "/tmp/critter-bench-XXXXXX";
+        path_ = mkdtemp(dir);
+        std::ofstream(path_ + "/small.html") << std::string(1024, 'x');
+        std::ofstream(path_ + "/large.html") << std::string(4 * 1024 * 1024, 'x');
+    }
+
+    ~DocRoot()
+    {
+        std::remove((path_ + "/small.html").c_str());
+        std::remove((path_ + "/large.html").c_str());
+        rmdir(path_.c_str());
+    }
+
+    const std::string& path() const { return path_; }
+
+private:
+    std::string path_;
+};
+
+// serve_file_from for the small (0) or large (1) file, with or without
+// a cache large enough to hold it.
+void serve_file_from(benchmark::State& state)
+{
+    static DocRoot root;
+    detail::FileMount mount;
+    mount.doc_root = root.path();
+    mount.prefix = "/files";
+    if(state.range(1))
+        mount.cache = std::make_shared<detail::FileCache>(16 * 1024 * 1024, 8 * 1024 * 1024);
+    auto const target = state.range(0) ? "/files/large.html" : "/files/small.html";
+    for(auto _: state)
+    {
+        Request req{http::verb::get, target, 11};
+        benchmark::DoNotOptimize(detail::serve_file_from(mount, std::move(req)));
+    }
+}
+BENCHMARK(serve_file_from)->ArgNames({"large", "cached"})->Args({0, 0})->Args({1, 0})->Args({0, 1})->Args({1, 1});
+
+}
+
+BENCHMARK_MAIN();
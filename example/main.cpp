@@ -14,12 +14,51 @@ int main(int, const char**)
         std::cout << req.body() << std::endl;
         return "ok\n";
     });
+    server.add_http_handler(http::verb::get, "/hello/{name}", [](auto&& req, const critter::PathParams& params)
+    {
+        return "Hello " + std::string(*params.get("name")) + "\n";
+    });
+    server.add_offloaded_http_handler(http::verb::get, "/slow/?", [](auto&& req)
+    {
+        // runs on the worker pool, the I/O thread keeps serving meanwhile
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return "Done\n";
+    });
+    server.add_chunked_http_handler(http::verb::get, "/count/?", [](auto&& req, critter::ResponseWriter writer)
+    {
+        // each line is written once the previous one was sent, so that
+        // the response never waits in memory for a slow client
+        auto write_from = [](auto self, critter::ResponseWriter writer, int i) -> void {
+            if(i == 100000)
+                return writer.close();
+            writer.async_write(std::to_string(i) + "\n", [self, writer, i](boost::system::error_code ec) {
+                if(!ec) self(self, writer, i + 1);
+            });
+        };
+        write_from(write_from, writer, 0);
+    });
+    server.add_streaming_http_handler(http::verb::put, "/upload/?", [](const critter::RequestHeader& header)
+    {
+        // the body is not buffered, each chunk is seen as it arrives
+        auto size = std::make_shared<std::size_t>(0);
+        return critter::BodyConsumer(
+            [size](std::string_view chunk) { *size += chunk.size(); },
+            [size] { return "Received " + std::to_string(*size) + " bytes\n"; });
+    }, 1024 * 1024 * 1024);
+    auto events = std::make_shared<critter::EventChannel>();
+    server.add_sse_handler("/events/?", events);
     server.add_ws_handler("/ws(/.*)?", [&](auto msg, auto& session) {
         std::cout << msg << std::endl;
-        // echo the message to all clients
-        for(auto& session: server.get_ws_sessions()) session->send(msg);
+        // echo the message to all clients, and to the event stream
+        server.broadcast(msg);
+        events->publish(msg, "message");
     });
-    server.serve_files("/", "./www/");
+    server.add_metrics_handler("/metrics");
+    critter::StaticFileOptions files;
+    files.cache_size = 16 * 1024 * 1024;
+    files.precompressed = true;
+    files.compress = true;
+    server.serve_files("/", "./www/", files);
 
     std::cout << "Server started" << std::endl; 
     server.run();
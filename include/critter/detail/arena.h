@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace critter::detail
+{
+
+// Monotonic memory resource owned by a connection. Allocations bump a
+// pointer and are never freed individually; reset() rewinds the arena once
+// the exchange it served is over. When an exchange overflowed the current
+// block, the next reset() replaces the chain with a single block sized for
+// it (up to max_retained bytes), so a connection with steady traffic stops
+// calling the global allocator after its first few requests.
+class Arena
+{
+public:
+    explicit Arena(std::size_t initial_size = 4096, std::size_t max_retained = 64 * 1024)
+        : next_size_(initial_size), max_retained_(std::max(initial_size, max_retained))
+    {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        release();
+    }
+
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        auto p = align(ptr_, alignment);
+        if(!p || size > static_cast<std::size_t>(end_ - p))
+        {
+            grow(size + alignment);
+            p = align(ptr_, alignment);
+        }
+        ptr_ = p + size;
+        return p;
+    }
+
+    void reset()
+    {
+        if(head_ && head_->next)
+        {
+            std::size_t total = 0;
+            for(auto block = head_; block; block = block->next)
+                total += block->size;
+            release();
+            next_size_ = std::min(total, max_retained_);
+            grow(0);
+        }
+        else if(head_)
+        {
+            ptr_ = head_->data();
+        }
+    }
+
+    // Arena that default-constructed ArenaAllocators bind to on this thread.
+    static Arena*& current()
+    {
+        static thread_local Arena* arena = nullptr;
+        return arena;
+    }
+
+    // Makes `arena` the current one for the lifetime of the scope. Must not
+    // span a suspension point: other sessions run on the same thread.
+    class Scope
+    {
+    public:
+        explicit Scope(Arena& arena) : previous_(current()) { current() = &arena; }
+        ~Scope() { current() = previous_; }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Arena* previous_;
+    };
+
+private:
+    struct Block
+    {
+        Block* next;
+        std::size_t size;
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+    static char* align(char* p, std::size_t alignment)
+    {
+        if(!p) return nullptr;
+        auto const n = reinterpret_cast<std::uintptr_t>(p);
+        return reinterpret_cast<char*>((n + alignment - 1) & ~(alignment - 1));
+    }
+
+    void grow(std::size_t min_size)
+    {
+        auto const size = std::max(next_size_, min_size);
+        auto block = static_cast<Block*>(::operator new(sizeof(Block) + size));
+        block->next = head_;
+        block->size = size;
+        head_ = block;
+        ptr_ = block->data();
+        end_ = ptr_ + size;
+        next_size_ = std::min(size * 2, max_retained_);
+    }
+
+    void release()
+    {
+        while(head_)
+        {
+            auto next = head_->next;
+            ::operator delete(head_);
+            head_ = next;
+        }
+        ptr_ = end_ = nullptr;
+    }
+
+    Block* head_ = nullptr;
+    char* ptr_ = nullptr;
+    char* end_ = nullptr;
+    std::size_t next_size_;
+    const std::size_t max_retained_;
+};
+
+// Allocator drawing from an Arena, or from the heap when it has none. A
+// default-constructed allocator binds to Arena::current(), which the server
+// sets while a handler runs, so handlers building their own Response
+// without naming an allocator still allocate from the connection's arena.
+template<class T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() noexcept : arena_(Arena::current()) {}
+    explicit ArenaAllocator(Arena* arena) noexcept : arena_(arena) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(other.arena()) {}
+
+    T* allocate(std::size_t n)
+    {
+        if(arena_)
+            return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept
+    {
+        if(!arena_)
+            std::allocator<T>().deallocate(p, n);
+    }
+
+    Arena* arena() const { return arena_; }
+
+    template<class U>
+    friend bool operator==(const ArenaAllocator& a, const ArenaAllocator<U>& b) { return a.arena_ == b.arena(); }
+    template<class U>
+    friend bool operator!=(const ArenaAllocator& a, const ArenaAllocator<U>& b) { return a.arena_ != b.arena(); }
+
+private:
+    Arena* arena_;
+};
+
+// An allocator of type Allocator for the given arena; allocators that
+// cannot use one are default-constructed.
+template<class Allocator>
+Allocator allocator_for(Arena& arena)
+{
+    if constexpr (std::is_constructible_v<Allocator, Arena*>)
+        return Allocator(&arena);
+    else
+        return Allocator();
+}
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <array>
+#include <cstdlib>
+#include <optional>
+#include <string>
+
+#if defined(CRITTER_WITH_ZLIB)
+#   include <zlib.h>
+#endif
+#if defined(CRITTER_WITH_BROTLI)
+#   include <brotli/encode.h>
+#endif
+
+namespace critter::detail
+{
+
+// Content codings a static file may be served with, in server preference
+// order. Precompressed siblings are found under `path + extension`; on the
+// fly compression is only available for the codings compiled in with
+// CRITTER_WITH_ZLIB (gzip) and CRITTER_WITH_BROTLI (br).
+enum class Encoding { br, zstd, gzip, identity };
+
+struct EncodingInfo
+{
+    Encoding encoding;
+    const char* token;
+    const char* extension;
+};
+
+inline const std::array<EncodingInfo, 3>& content_codings()
+{
+    static const std::array<EncodingInfo, 3> codings = {{
+        {Encoding::br, "br", ".br"},
+        {Encoding::zstd, "zstd", ".zst"},
+        {Encoding::gzip, "gzip", ".gz"},
+    }};
+    return codings;
+}
+
+inline const char* coding_token(Encoding encoding)
+{
+    for(auto& coding: content_codings())
+        if(coding.encoding == encoding) return coding.token;
+    return "identity";
+}
+
+// The q-value an Accept-Encoding header gives to `token`, 0 if refused.
+inline double
+accepted_quality(boost::beast::string_view accept_encoding, boost::beast::string_view token)
+{
+    using boost::beast::iequals;
+    std::optional<double> exact, wildcard;
+    while(!accept_encoding.empty())
+    {
+        auto const end = std::min(accept_encoding.find(','), accept_encoding.size());
+        auto item = accept_encoding.substr(0, end);
+        accept_encoding.remove_prefix(std::min(end + 1, accept_encoding.size()));
+
+        double q = 1.0;
+        auto const semi = item.find(';');
+        if(semi != boost::beast::string_view::npos)
+        {
+            auto params = item.substr(semi + 1);
+            item = item.substr(0, semi);
+            auto const qpos = params.find("q=");
+            if(qpos != boost::beast::string_view::npos)
+                q = std::strtod(params.substr(qpos + 2).to_string().c_str(), nullptr);
+        }
+        while(!item.empty() && item.front() == ' ') item.remove_prefix(1);
+        while(!item.empty() && item.back() == ' ') item.remove_suffix(1);
+
+        if(iequals(item, token)) exact = q;
+        else if(item == "*") wildcard = q;
+    }
+    return exact ? *exact : wildcard ? *wildcard : 0.0;
+}
+
+// Whether a response of this type is worth compressing.
+inline bool
+is_compressible(boost::beast::string_view mime, boost::beast::string_view path)
+{
+    using boost::beast::iequals;
+    if(path.size() >= 5 && iequals(path.substr(path.size() - 5), ".svgz"))
+        return false;
+    return mime.starts_with("text/")
+        || mime == "application/javascript"
+        || mime == "application/json"
+        || mime == "application/xml"
+        || mime == "image/svg+xml";
+}
+
+// Whether this build can compress with `encoding` on the fly.
+inline bool
+can_compress(Encoding encoding)
+{
+    switch(encoding)
+    {
+#if defined(CRITTER_WITH_ZLIB)
+    case Encoding::gzip: return true;
+#endif
+#if defined(CRITTER_WITH_BROTLI)
+    case Encoding::br: return true;
+#endif
+    default: return false;
+    }
+}
+
+// Compress `data` with the maximum ratio; meant to be done once per file.
+inline std::optional<std::string>
+compress(Encoding encoding, boost::beast::string_view data)
+{
+#if defined(CRITTER_WITH_ZLIB)
+    if(encoding == Encoding::gzip)
+    {
+        z_stream zs{};
+        if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+            return std::nullopt;
+        std::string out(deflateBound(&zs, static_cast<uLong>(data.size())), '\0');
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        zs.avail_in = static_cast<uInt>(data.size());
+        zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        zs.avail_out = static_cast<uInt>(out.size());
+        auto const rc = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        if(rc != Z_STREAM_END) return std::nullopt;
+        return out;
+    }
+#endif
+#if defined(CRITTER_WITH_BROTLI)
+    if(encoding == Encoding::br)
+    {
+        std::size_t size = BrotliEncoderMaxCompressedSize(data.size());
+        std::string out(size, '\0');
+        if(!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                data.size(), reinterpret_cast<const uint8_t*>(data.data()),
+                &size, reinterpret_cast<uint8_t*>(&out[0])))
+            return std::nullopt;
+        out.resize(size);
+        return out;
+    }
+#endif
+    (void)encoding;
+    (void)data;
+    return std::nullopt;
+}
+
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#define BOOST_COROUTINES_NO_DEPRECATION_WARNING
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+#include <boost/version.hpp>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if !defined(CRITTER_WITH_AWAITABLE)
+#   include <boost/asio/spawn.hpp>
+#else
+#   include <boost/asio/awaitable.hpp>
+#   include <boost/asio/co_spawn.hpp>
+#   include <boost/asio/redirect_error.hpp>
+#   include <boost/asio/use_awaitable.hpp>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+// The server's coroutines are written once for two backends. By default
+// they are stackful (asio::spawn); with CRITTER_WITH_AWAITABLE, in C++20,
+// they are asio::awaitable, whose frames take a few hundred bytes instead
+// of a whole stack. A coroutine returns detail::Task, takes a
+// detail::Yield, passes `yield[ec]` as completion token, prefixes the
+// operations and coroutines it waits for with CRITTER_AWAIT and returns
+// with CRITTER_CO_RETURN.
+#if defined(CRITTER_WITH_AWAITABLE)
+#   define CRITTER_AWAIT co_await
+#   define CRITTER_CO_RETURN co_return
+#else
+#   define CRITTER_AWAIT
+#   define CRITTER_CO_RETURN return
+#endif
+
+namespace critter
+{
+
+// Stacks of the coroutines running listeners, HTTP sessions and WebSocket
+// readers and writers.
+struct CoroutineOptions
+{
+    // Usable stack size of each coroutine; 0 keeps Boost's default.
+    std::size_t stack_size = 0;
+    // Map an inaccessible page below each stack, so that an overflow
+    // faults instead of silently corrupting memory (Boost 1.80 and later).
+    bool guard_page = false;
+    // Stacks kept for reuse once their coroutine is over (Boost 1.80 and
+    // later).
+    std::size_t max_pooled_stacks = 1024;
+};
+
+}
+
+namespace critter::detail
+{
+
+#if defined(CRITTER_WITH_AWAITABLE)
+using Task = boost::asio::awaitable<void>;
+
+// Completion tokens of the awaitable backend, spelled like a yield_context.
+struct Yield
+{
+    auto operator[](boost::system::error_code& ec) const
+    {
+        return boost::asio::redirect_error(boost::asio::use_awaitable, ec);
+    }
+};
+#else
+using Task = void;
+using Yield = boost::asio::yield_context;
+#endif
+
+// Fixed-size coroutine stacks recycled across coroutines, so that a new
+// connection reuses the stack of a finished one instead of mapping (and
+// faulting in) a fresh one. Meets Boost.Context's StackAllocator concept
+// through PooledStackAllocator. Thread-safe.
+class StackPool
+{
+public:
+    StackPool(std::size_t stack_size, bool guard_page, std::size_t max_pooled)
+        : size_(round_to_page(stack_size)), guard_(guard_page ? page_size() : 0), max_pooled_(max_pooled)
+    {
+    }
+
+    StackPool(const StackPool&) = delete;
+    StackPool& operator=(const StackPool&) = delete;
+
+    ~StackPool()
+    {
+        for(auto base: free_)
+            unmap(base);
+    }
+
+    std::size_t stack_size() const { return size_; }
+
+    boost::context::stack_context allocate()
+    {
+        void* base = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(!free_.empty())
+            {
+                base = free_.back();
+                free_.pop_back();
+            }
+        }
+        if(!base)
+            base = map();
+
+        boost::context::stack_context ctx;
+        ctx.size = size_;
+        ctx.sp = static_cast<char*>(base) + guard_ + size_;
+        return ctx;
+    }
+
+    void deallocate(boost::context::stack_context& ctx) noexcept
+    {
+        void* base = static_cast<char*>(ctx.sp) - size_ - guard_;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(free_.size() < max_pooled_)
+            {
+                try {
+                    free_.push_back(base);
+                    return;
+                } catch (const std::bad_alloc&) {
+                }
+            }
+        }
+        unmap(base);
+    }
+
+private:
+    static std::size_t page_size()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        static const std::size_t size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        return size;
+#else
+        return 4096;
+#endif
+    }
+
+    static std::size_t round_to_page(std::size_t size)
+    {
+        auto const page = page_size();
+        size = std::max(size, boost::context::stack_traits::minimum_size());
+        return (size + page - 1) / page * page;
+    }
+
+    void* map()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        void* base = ::mmap(nullptr, guard_ + size_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(base == MAP_FAILED)
+            throw std::bad_alloc();
+        if(guard_)
+            ::mprotect(base, guard_, PROT_NONE);
+        return base;
+#else
+        void* base = std::malloc(guard_ + size_);
+        if(!base)
+            throw std::bad_alloc();
+        return base;
+#endif
+    }
+
+    void unmap(void* base) noexcept
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        ::munmap(base, guard_ + size_);
+#else
+        std::free(base);
+#endif
+    }
+
+    const std::size_t size_;
+    const std::size_t guard_;
+    const std::size_t max_pooled_;
+    std::mutex mutex_;
+    std::vector<void*> free_;
+};
+
+// Copyable StackAllocator handing out stacks from a shared StackPool.
+class PooledStackAllocator
+{
+public:
+    explicit PooledStackAllocator(std::shared_ptr<StackPool> pool) : pool_(std::move(pool)) {}
+
+    boost::context::stack_context allocate() { return pool_->allocate(); }
+    void deallocate(boost::context::stack_context& ctx) noexcept { pool_->deallocate(ctx); }
+
+private:
+    std::shared_ptr<StackPool> pool_;
+};
+
+// Spawns the server's coroutines, given as `f(yield)`; `f` lives as long
+// as its coroutine. Boost 1.80 and later take a stack allocator, which is
+// the StackPool; older versions only take a stack size, and allocate each
+// stack with malloc. Awaitable coroutines have no stack to configure.
+class Spawner
+{
+public:
+    Spawner() : Spawner(CoroutineOptions()) {}
+
+    explicit Spawner(const CoroutineOptions& options)
+#if defined(CRITTER_WITH_AWAITABLE)
+    {
+        (void)options;
+    }
+#else
+#   if BOOST_VERSION >= 108000
+        : pool_(std::make_shared<StackPool>(
+            options.stack_size ? options.stack_size : boost::context::stack_traits::default_size(),
+            options.guard_page, options.max_pooled_stacks))
+#   else
+        : attributes_(options.stack_size ? boost::coroutines::attributes(options.stack_size)
+                                         : boost::coroutines::attributes())
+#   endif
+    {
+    }
+#endif
+
+    // Exceptions escaping the coroutine propagate out of io_context::run().
+    template<class Executor, class F>
+    void operator()(const Executor& ex, F&& f) const
+    {
+#if defined(CRITTER_WITH_AWAITABLE)
+        boost::asio::co_spawn(ex, [f = std::forward<F>(f)]() mutable { return f(Yield()); },
+            [](std::exception_ptr e) { if(e) std::rethrow_exception(e); });
+#elif BOOST_VERSION >= 108000
+        boost::asio::spawn(ex, std::allocator_arg, PooledStackAllocator(pool_), std::forward<F>(f),
+            [](std::exception_ptr e) { if(e) std::rethrow_exception(e); });
+#else
+        boost::asio::spawn(ex, std::forward<F>(f), attributes_);
+#endif
+    }
+
+private:
+#if defined(CRITTER_WITH_AWAITABLE)
+#elif BOOST_VERSION >= 108000
+    std::shared_ptr<StackPool> pool_;
+#else
+    boost::coroutines::attributes attributes_;
+#endif
+};
+
+// Type-erases a completion handler, which may be move-only, into a function
+// posting it to its associated executor, `executor` by default. Operations
+// completed from other threads keep their waiting coroutines as these.
+template<class... Args, class Handler, class Executor>
+std::function<void(Args...)> erase_completion(Handler handler, const Executor& executor)
+{
+    auto shared = std::make_shared<Handler>(std::move(handler));
+    auto associated = boost::asio::get_associated_executor(*shared, executor);
+    return [shared, associated](Args... args) {
+        boost::asio::post(associated, [shared, args...]() mutable {
+            (*shared)(std::move(args)...);
+        });
+    };
+}
+
+}
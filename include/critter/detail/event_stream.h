@@ -0,0 +1,215 @@
+#pragma once
+
+#include "coroutine.h"
+#include "websocket_session.h"
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/system/error_code.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace critter
+{
+
+struct EventChannelOptions
+{
+    // Events queued for a subscriber that reads slower than they are
+    // published, beyond which the policy applies: drop_oldest discards the
+    // oldest event not yet being written, drop_newest the event published,
+    // and disconnect closes the connection.
+    std::size_t max_queued_events = 1024;
+    SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::drop_oldest;
+};
+
+}
+
+namespace critter::detail
+{
+
+// Events published to one subscriber and not written yet, handed by
+// publishers on any thread to the subscriber's session.
+class EventSubscriber: public std::enable_shared_from_this<EventSubscriber>
+{
+public:
+    using Event = std::shared_ptr<const std::string>;
+
+    EventSubscriber(boost::asio::any_io_executor executor, const EventChannelOptions& options)
+        : executor_(std::move(executor)), options_(options)
+    {
+    }
+
+    void push(const Event& event)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if(closed_)
+            return;
+        if(queued_.size() >= options_.max_queued_events)
+        {
+            switch(options_.slow_consumer_policy)
+            {
+            case SlowConsumerPolicy::drop_oldest:
+                queued_.pop_front();
+                break;
+            case SlowConsumerPolicy::drop_newest:
+                return;
+            case SlowConsumerPolicy::disconnect:
+                queued_.clear();
+                closed_ = true;
+                return notify(lock);
+            }
+        }
+        queued_.push_back(event);
+        notify(lock);
+    }
+
+    // The session ends once the events queued are written.
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        closed_ = true;
+        notify(lock);
+    }
+
+    // Session side: completes with void(error_code, std::vector<Event>) and
+    // every event queued so far, or eof once disconnected.
+    template<class Token>
+    auto async_next(Token&& token)
+    {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, std::vector<Event>)>(
+            [self = shared_from_this()](auto handler) {
+                auto next = erase_completion<boost::system::error_code, std::vector<Event>>(
+                    std::move(handler), self->executor_);
+                std::unique_lock<std::mutex> lock(self->mutex_);
+                if(self->queued_.empty() && !self->closed_)
+                    return void(self->waiter_ = std::move(next));
+                auto events = self->take();
+                lock.unlock();
+                auto const ec = events.empty() ? boost::asio::error::eof : boost::system::error_code();
+                next(ec, std::move(events));
+            }, token);
+    }
+
+private:
+    // Called with the mutex held.
+    std::vector<Event> take()
+    {
+        std::vector<Event> events(std::make_move_iterator(queued_.begin()), std::make_move_iterator(queued_.end()));
+        queued_.clear();
+        return events;
+    }
+
+    // Completes the session waiting for events, if any, and unlocks.
+    void notify(std::unique_lock<std::mutex>& lock)
+    {
+        auto waiter = std::exchange(waiter_, nullptr);
+        if(!waiter)
+            return;
+        auto events = take();
+        lock.unlock();
+        auto const ec = events.empty() ? boost::asio::error::eof : boost::system::error_code();
+        waiter(ec, std::move(events));
+    }
+
+    boost::asio::any_io_executor executor_;
+    const EventChannelOptions options_;
+    std::mutex mutex_;
+    std::deque<Event> queued_;
+    std::function<void(boost::system::error_code, std::vector<Event>)> waiter_;
+    bool closed_ = false;
+};
+
+}
+
+namespace critter
+{
+
+// Server-Sent Events published to the clients of the routes added with
+// add_sse_handler. Each event is encoded once, and the subscribers' queues
+// share it. Safe to use from any thread.
+class EventChannel
+{
+public:
+    explicit EventChannel(const EventChannelOptions& options = EventChannelOptions())
+        : options_(options)
+    {
+    }
+
+    // Sends `data`, which may span several lines, to every subscriber, as
+    // an event of type `event` with identifier `id` when these are given.
+    void publish(std::string_view data, std::string_view event = {}, std::string_view id = {})
+    {
+        auto encoded = std::make_shared<std::string>();
+        if(!event.empty())
+            encoded->append("event: ").append(event).append("\n");
+        if(!id.empty())
+            encoded->append("id: ").append(id).append("\n");
+        for(;;)
+        {
+            auto const eol = data.find('\n');
+            auto line = data.substr(0, eol);
+            if(!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+            encoded->append("data: ").append(line).append("\n");
+            if(eol == std::string_view::npos)
+                break;
+            data.remove_prefix(eol + 1);
+        }
+        encoded->append("\n");
+        std::shared_ptr<const std::string> shared = std::move(encoded);
+        for_each([&](detail::EventSubscriber& subscriber) { subscriber.push(shared); });
+    }
+
+    // Subscribers connected, including the ones whose connection dropped
+    // since the last event.
+    std::size_t subscribers() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::count_if(subscribers_.begin(), subscribers_.end(),
+                             [](auto& subscriber) { return !subscriber.expired(); });
+    }
+
+    // Ends the streams of the current subscribers.
+    void close()
+    {
+        for_each([](detail::EventSubscriber& subscriber) { subscriber.close(); });
+    }
+
+    // For the sessions of the channel's routes: events are queued for the
+    // subscriber returned until it is destroyed.
+    std::shared_ptr<detail::EventSubscriber> subscribe(boost::asio::any_io_executor executor)
+    {
+        auto subscriber = std::make_shared<detail::EventSubscriber>(std::move(executor), options_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        subscribers_.push_back(subscriber);
+        return subscriber;
+    }
+
+private:
+    // Runs `f` for each live subscriber, forgetting the others.
+    template<class F>
+    void for_each(F&& f)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(), [&](auto& weak) {
+            auto subscriber = weak.lock();
+            if(subscriber)
+                f(*subscriber);
+            return !subscriber;
+        }), subscribers_.end());
+    }
+
+    const EventChannelOptions options_;
+    mutable std::mutex mutex_;
+    std::vector<std::weak_ptr<detail::EventSubscriber>> subscribers_;
+};
+
+}
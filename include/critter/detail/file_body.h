@@ -0,0 +1,265 @@
+#pragma once
+
+#include "coroutine.h"
+#include "timer_wheel.h"
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#   include <sys/sendfile.h>
+#   include <cerrno>
+#endif
+
+namespace critter::detail
+{
+
+namespace http = boost::beast::http;
+
+// What a static response needs to know about a file before opening it.
+struct FileInfo
+{
+    std::uint64_t inode = 0;
+    std::uint64_t size = 0;
+    std::time_t mtime = 0;
+
+    bool operator==(const FileInfo& other) const
+    {
+        return inode == other.inode && size == other.size && mtime == other.mtime;
+    }
+    bool operator!=(const FileInfo& other) const { return !(*this == other); }
+};
+
+// Returns the metadata of a regular file, or nothing if `path` does not
+// name one.
+inline std::optional<FileInfo> stat_file(const char* path)
+{
+    struct stat st;
+    if(::stat(path, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+        return std::nullopt;
+    FileInfo info;
+    info.inode = static_cast<std::uint64_t>(st.st_ino);
+    info.size = static_cast<std::uint64_t>(st.st_size);
+    info.mtime = st.st_mtime;
+    return info;
+}
+
+// Size of the chunks FileBody's writer reads, one TLS record's worth.
+const std::size_t FILE_BUFFER_SIZE = 16 * 1024;
+
+// A Beast Body serving byte ranges of an open file. By default the body is
+// the whole file; select_range narrows it to one range and add_part turns
+// it into a sequence of file ranges, each preceded by a literal head and
+// followed by a closing tail, as needed for multipart/byteranges. Unlike
+// http::file_body the file is never read through user space when it is
+// sent over a plain TCP socket (see send_file_body); other streams, such as
+// TLS, fall back to the writer below, which reuses one FILE_BUFFER_SIZE
+// buffer for the whole body, so files of any size are served in bounded
+// memory.
+struct FileBody
+{
+    struct Part
+    {
+        std::string head;
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    class value_type
+    {
+    public:
+        void open(const char* path, boost::beast::error_code& ec)
+        {
+            file_.open(path, boost::beast::file_mode::scan, ec);
+            if(ec) return;
+            file_size_ = file_.size(ec);
+            whole_ = {{}, 0, file_size_};
+        }
+
+        bool is_open() const { return file_.is_open(); }
+        boost::beast::file& file() { return file_; }
+        std::uint64_t file_size() const { return file_size_; }
+
+        void select_range(std::uint64_t offset, std::uint64_t size)
+        {
+            whole_ = {{}, offset, size};
+        }
+
+        void add_part(std::string head, std::uint64_t offset, std::uint64_t size)
+        {
+            parts_.push_back({std::move(head), offset, size});
+        }
+
+        void set_tail(std::string tail) { tail_ = std::move(tail); }
+
+        std::size_t part_count() const { return parts_.empty() ? 1 : parts_.size(); }
+        const Part& part(std::size_t i) const { return parts_.empty() ? whole_ : parts_[i]; }
+        const std::string& tail() const { return tail_; }
+
+        std::uint64_t size() const
+        {
+            std::uint64_t total = tail_.size();
+            for(std::size_t i = 0; i < part_count(); ++i)
+                total += part(i).head.size() + part(i).size;
+            return total;
+        }
+
+    private:
+        boost::beast::file file_;
+        std::uint64_t file_size_ = 0;
+        Part whole_{{}, 0, 0};
+        std::vector<Part> parts_;
+        std::string tail_;
+    };
+
+    static std::uint64_t size(const value_type& body) { return body.size(); }
+
+    class writer
+    {
+    public:
+        using const_buffers_type = boost::asio::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(http::header<isRequest, Fields>&, value_type& body)
+            : body_(body)
+        {
+        }
+
+        void init(boost::beast::error_code& ec)
+        {
+            ec = {};
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>>
+        get(boost::beast::error_code& ec)
+        {
+            ec = {};
+            while(part_ < body_.part_count())
+            {
+                auto& part = body_.part(part_);
+                if(!started_)
+                {
+                    started_ = true;
+                    remain_ = part.size;
+                    body_.file().seek(part.offset, ec);
+                    if(ec) return boost::none;
+                    if(!part.head.empty())
+                        return {{boost::asio::buffer(part.head), true}};
+                }
+                if(remain_ > 0)
+                {
+                    auto const amount = static_cast<std::size_t>(
+                        std::min<std::uint64_t>(remain_, sizeof(buf_)));
+                    auto const n = body_.file().read(buf_, amount, ec);
+                    if(ec) return boost::none;
+                    if(n == 0)
+                    {
+                        ec = http::error::short_read;
+                        return boost::none;
+                    }
+                    remain_ -= n;
+                    return {{const_buffers_type{buf_, n}, true}};
+                }
+                ++part_;
+                started_ = false;
+            }
+            if(!body_.tail().empty() && !tail_sent_)
+            {
+                tail_sent_ = true;
+                return {{boost::asio::buffer(body_.tail()), false}};
+            }
+            return boost::none;
+        }
+
+    private:
+        value_type& body_;
+        std::size_t part_ = 0;
+        bool started_ = false;
+        bool tail_sent_ = false;
+        std::uint64_t remain_ = 0;
+        char buf_[FILE_BUFFER_SIZE];
+    };
+};
+
+#if defined(__linux__)
+// Copies a file range straight from the page cache to the socket with
+// sendfile(2), waiting for writability whenever the socket buffer fills.
+// Each copy restarts `deadline`.
+inline Task
+send_file_range(
+    boost::asio::ip::tcp::socket& socket,
+    boost::beast::file& file,
+    std::uint64_t offset,
+    std::uint64_t size,
+    Deadline& deadline,
+    Yield yield,
+    boost::beast::error_code& ec)
+{
+    socket.native_non_blocking(true, ec);
+    if(ec) CRITTER_CO_RETURN;
+
+    auto position = static_cast<off_t>(offset);
+    auto remain = size;
+    while(remain > 0)
+    {
+        auto const n = ::sendfile(socket.native_handle(), file.native_handle(), &position,
+            static_cast<std::size_t>(std::min<std::uint64_t>(remain, 0x7ffff000)));
+        if(n > 0)
+        {
+            remain -= static_cast<std::uint64_t>(n);
+            deadline.restart();
+        }
+        else if(n == 0)
+        {
+            ec = http::error::short_read;
+            CRITTER_CO_RETURN;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            CRITTER_AWAIT socket.async_wait(boost::asio::ip::tcp::socket::wait_write, yield[ec]);
+            if(ec) CRITTER_CO_RETURN;
+        }
+        else if(errno != EINTR)
+        {
+            ec.assign(errno, boost::system::system_category());
+            CRITTER_CO_RETURN;
+        }
+    }
+    ec = {};
+}
+
+// Writes every part of the body, sending the file ranges with sendfile(2).
+inline Task
+send_file_body(
+    boost::asio::ip::tcp::socket& socket,
+    FileBody::value_type& body,
+    Deadline& deadline,
+    Yield yield,
+    boost::beast::error_code& ec)
+{
+    ec = {};
+    for(std::size_t i = 0; i < body.part_count(); ++i)
+    {
+        auto& part = body.part(i);
+        if(!part.head.empty())
+        {
+            CRITTER_AWAIT boost::asio::async_write(socket, boost::asio::buffer(part.head), yield[ec]);
+            if(ec) CRITTER_CO_RETURN;
+        }
+        CRITTER_AWAIT send_file_range(socket, body.file(), part.offset, part.size, deadline, yield, ec);
+        if(ec) CRITTER_CO_RETURN;
+    }
+    if(!body.tail().empty())
+        CRITTER_AWAIT boost::asio::async_write(socket, boost::asio::buffer(body.tail()), yield[ec]);
+}
+#endif
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "file_body.h"
+#include <boost/asio/buffer.hpp>
+#include <array>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace critter::detail
+{
+
+// A static file held in memory along with its pre-serialized header
+// fields (everything but the status line and the Connection header).
+// The key is the resolved path, qualified by the content coding when the
+// body was compressed on the fly.
+struct CachedFile
+{
+    std::string key;
+    FileInfo info;
+    std::string headers;
+    std::string body;
+};
+
+// Response to a request served from the FileCache. It is written as a
+// single gather-write of the status line, the shared header block, the
+// connection-specific end of the header and the shared body.
+class CachedResponse
+{
+public:
+    CachedResponse(std::shared_ptr<const CachedFile> file, unsigned version, bool keep_alive)
+        : file_(std::move(file)), version_(version), keep_alive_(keep_alive)
+    {
+    }
+
+    bool keep_alive() const { return keep_alive_; }
+
+    std::array<boost::asio::const_buffer, 4> buffers() const
+    {
+        static const std::string status_11 = "HTTP/1.1 200 OK\r\n";
+        static const std::string status_10 = "HTTP/1.0 200 OK\r\n";
+        static const std::string end = "\r\n";
+        static const std::string end_close = "Connection: close\r\n\r\n";
+        static const std::string end_keep_alive = "Connection: keep-alive\r\n\r\n";
+
+        const bool http11 = version_ >= 11;
+        const std::string& tail =
+            http11 ? (keep_alive_ ? end : end_close)
+                   : (keep_alive_ ? end_keep_alive : end);
+        return {
+            boost::asio::buffer(http11 ? status_11 : status_10),
+            boost::asio::buffer(file_->headers),
+            boost::asio::buffer(tail),
+            boost::asio::buffer(file_->body)};
+    }
+
+private:
+    std::shared_ptr<const CachedFile> file_;
+    unsigned version_;
+    bool keep_alive_;
+};
+
+// Bounded LRU cache of static files keyed by their resolved path. Entries
+// are checked against the file's current inode, size and mtime on every
+// lookup, so edited files are picked up without restarting the server.
+class FileCache
+{
+public:
+    FileCache(std::size_t capacity, std::size_t max_file_size)
+        : capacity_(capacity), max_file_size_(std::min(capacity, max_file_size))
+    {
+    }
+
+    std::size_t max_file_size() const { return max_file_size_; }
+
+    std::shared_ptr<const CachedFile> find(const std::string& key, const FileInfo& info)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = index_.find(key);
+        if(found == index_.end())
+            return nullptr;
+        if((*found->second)->info != info)
+        {
+            erase(found);
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, found->second);
+        return *found->second;
+    }
+
+    void insert(std::shared_ptr<const CachedFile> file)
+    {
+        if(file->body.size() > max_file_size_)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = index_.find(file->key);
+        if(found != index_.end())
+            erase(found);
+
+        size_ += file->body.size();
+        lru_.push_front(std::move(file));
+        index_.emplace(lru_.front()->key, lru_.begin());
+
+        while(size_ > capacity_)
+            erase(index_.find(lru_.back()->key));
+    }
+
+private:
+    using Entries = std::list<std::shared_ptr<const CachedFile>>;
+    using Index = std::unordered_map<std::string, Entries::iterator>;
+
+    void erase(Index::iterator it)
+    {
+        size_ -= (*it->second)->body.size();
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+
+    const std::size_t capacity_;
+    const std::size_t max_file_size_;
+    std::mutex mutex_;
+    Entries lru_;
+    Index index_;
+    std::size_t size_ = 0;
+};
+
+}
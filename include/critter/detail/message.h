@@ -0,0 +1,37 @@
+#pragma once
+
+#include "arena.h"
+#include <boost/beast/http.hpp>
+#include <memory>
+#include <string>
+
+namespace critter
+{
+
+namespace http = boost::beast::http;
+
+// HTTP messages whose fields and string body use `Allocator`.
+template<class Allocator>
+using BasicRequest = http::request<
+    http::basic_string_body<char, std::char_traits<char>, Allocator>,
+    http::basic_fields<Allocator>>;
+
+template<class Allocator>
+using BasicResponse = http::response<
+    http::basic_string_body<char, std::char_traits<char>, Allocator>,
+    http::basic_fields<Allocator>>;
+
+// With CRITTER_WITH_ARENA, requests and responses are allocated from an
+// arena owned by the connection and rewound after each response: handlers
+// must not keep them, or views into them, once they returned.
+#if defined(CRITTER_WITH_ARENA)
+using MessageAllocator = detail::ArenaAllocator<char>;
+#else
+using MessageAllocator = std::allocator<char>;
+#endif
+
+using Request = BasicRequest<MessageAllocator>;
+using Response = BasicResponse<MessageAllocator>;
+using RequestHeader = http::request_header<http::basic_fields<MessageAllocator>>;
+
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace critter::detail
+{
+
+// A counter or gauge of one thread's shard. Only that thread writes it, so
+// updates are plain relaxed stores, and scrapes read it at any time.
+class Counter
+{
+public:
+    void add(std::int64_t n) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    std::int64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::int64_t> value_{0};
+};
+
+// Log-linear buckets, as in HDR histograms: values below 8 have their own
+// bucket, and each power of two above is split into 8 buckets, so that a
+// bucket is at most 12.5% wider than its values. Values from 2^32 on share
+// the last bucket.
+struct Histogram
+{
+    static constexpr unsigned sub_bits = 3;
+    static constexpr std::size_t sub_count = std::size_t(1) << sub_bits;
+    static constexpr unsigned max_exponent = 31;
+    static constexpr std::size_t bucket_count = (max_exponent - sub_bits + 2) * sub_count;
+
+    static std::size_t bucket(std::uint64_t value)
+    {
+        if(value < sub_count)
+            return static_cast<std::size_t>(value);
+        unsigned exponent = 63;
+        while(!(value >> exponent)) --exponent;
+        if(exponent > max_exponent)
+            return bucket_count - 1;
+        auto const shift = exponent - sub_bits;
+        return (shift + 1) * sub_count + static_cast<std::size_t>((value >> shift) & (sub_count - 1));
+    }
+
+    // The highest value counted in `bucket`.
+    static std::uint64_t upper_bound(std::size_t bucket)
+    {
+        if(bucket < sub_count)
+            return bucket;
+        auto const shift = bucket / sub_count - 1;
+        return ((sub_count + bucket % sub_count + 1) << shift) - 1;
+    }
+};
+
+// What one thread recorded for the requests of one route.
+struct RouteStats
+{
+    std::array<Counter, 5> responses;   // by status class, 1xx to 5xx
+    Counter request_bytes;
+    Counter response_bytes;
+    Counter latency_sum;                // microseconds
+    std::array<Counter, Histogram::bucket_count> latency;
+};
+
+// Stages of a connection whose failures are counted.
+inline constexpr std::array<const char*, 6> error_stages = {"accept", "handshake", "read", "write", "shutdown", "timeout"};
+
+// Everything one thread recorded. Routes are numbered by their slot, which
+// is their handler's index in the registry plus one, 0 being requests that
+// matched no route; their stats are allocated by blocks on first use.
+class MetricsShard
+{
+public:
+    static constexpr std::size_t block_size = 64;
+    static constexpr std::size_t max_blocks = 256;
+
+    MetricsShard() = default;
+    MetricsShard(const MetricsShard&) = delete;
+    MetricsShard& operator=(const MetricsShard&) = delete;
+
+    ~MetricsShard()
+    {
+        for(auto& block: blocks_)
+            delete[] block.load();
+    }
+
+    void record(std::size_t slot, unsigned status, std::uint64_t request_bytes,
+                std::uint64_t response_bytes, std::uint64_t microseconds)
+    {
+        auto const block = slot / block_size;
+        if(block >= max_blocks)
+            return;
+        auto stats = blocks_[block].load(std::memory_order_acquire);
+        if(!stats)
+        {
+            stats = new RouteStats[block_size];
+            blocks_[block].store(stats, std::memory_order_release);
+        }
+        auto& route = stats[slot % block_size];
+        if(status >= 100 && status < 600)
+            route.responses[status / 100 - 1].add(1);
+        route.request_bytes.add(static_cast<std::int64_t>(request_bytes));
+        route.response_bytes.add(static_cast<std::int64_t>(response_bytes));
+        route.latency_sum.add(static_cast<std::int64_t>(microseconds));
+        route.latency[Histogram::bucket(microseconds)].add(1);
+    }
+
+    void error(std::string_view stage)
+    {
+        for(std::size_t i = 0; i < error_stages.size(); ++i)
+            if(stage == error_stages[i])
+                return errors[i].add(1);
+    }
+
+    // Null until the thread recorded a request of the slot's block.
+    const RouteStats* route(std::size_t slot) const
+    {
+        auto const block = slot / block_size;
+        auto stats = block < max_blocks ? blocks_[block].load(std::memory_order_acquire) : nullptr;
+        return stats ? &stats[slot % block_size] : nullptr;
+    }
+
+    Counter connections;
+    Counter http_sessions;
+    Counter websocket_sessions;
+    Counter sse_sessions;
+    std::array<Counter, error_stages.size()> errors;
+
+private:
+    std::array<std::atomic<RouteStats*>, max_blocks> blocks_{};
+};
+
+// The shards of the threads that recorded metrics for one server, merged
+// when scraped. Shards outlive their thread, keeping its counts.
+class Metrics
+{
+public:
+    // The shard of the calling thread.
+    MetricsShard& local()
+    {
+        thread_local std::uint64_t cached_id = 0;
+        thread_local MetricsShard* cached = nullptr;
+        if(cached_id == id_)
+            return *cached;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const thread = std::this_thread::get_id();
+        auto found = std::find_if(shards_.begin(), shards_.end(), [&](auto& shard) { return shard.first == thread; });
+        if(found == shards_.end())
+            found = shards_.emplace(shards_.end(), thread, std::make_unique<MetricsShard>());
+        cached_id = id_;
+        cached = found->second.get();
+        return *cached;
+    }
+
+    // Counts one in a gauge of the calling thread's shard for its lifetime;
+    // it may end on another thread.
+    class GaugeScope
+    {
+    public:
+        GaugeScope(Metrics& metrics, Counter MetricsShard::*gauge) : metrics_(metrics), gauge_(gauge)
+        {
+            (metrics_.local().*gauge_).add(1);
+        }
+        GaugeScope(const GaugeScope&) = delete;
+        GaugeScope& operator=(const GaugeScope&) = delete;
+        ~GaugeScope() { (metrics_.local().*gauge_).add(-1); }
+
+    private:
+        Metrics& metrics_;
+        Counter MetricsShard::*gauge_;
+    };
+
+    // Formats what was recorded in the Prometheus text format; `labels(slot)`
+    // gives the route and method labels of the slots 1 to `slots` - 1.
+    template<class Labels>
+    std::string prometheus(std::size_t slots, Labels&& labels) const
+    {
+        static constexpr std::array<double, 4> quantiles = {0.5, 0.9, 0.99, 0.999};
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const sum = [&](auto&& get) {
+            std::int64_t total = 0;
+            for(auto& shard: shards_)
+                total += get(*shard.second);
+            return total;
+        };
+
+        std::string requests, latencies, request_bytes, response_bytes;
+        for(std::size_t slot = 0; slot < slots; ++slot)
+        {
+            RouteStats merged;
+            bool used = false;
+            for(auto& shard: shards_)
+            {
+                auto stats = shard.second->route(slot);
+                if(!stats)
+                    continue;
+                used = true;
+                for(std::size_t i = 0; i < merged.responses.size(); ++i)
+                    merged.responses[i].add(stats->responses[i].get());
+                merged.request_bytes.add(stats->request_bytes.get());
+                merged.response_bytes.add(stats->response_bytes.get());
+                merged.latency_sum.add(stats->latency_sum.get());
+                for(std::size_t i = 0; i < Histogram::bucket_count; ++i)
+                    merged.latency[i].add(stats->latency[i].get());
+            }
+            std::int64_t count = 0;
+            for(auto& responses: merged.responses)
+                count += responses.get();
+            if(!used || !count)
+                continue;
+
+            std::string route = "(none)", method;
+            if(slot > 0)
+                std::tie(route, method) = labels(slot);
+            auto const label_set = "route=\"" + escape(route) + "\",method=\"" + escape(method) + "\"";
+
+            for(std::size_t i = 0; i < merged.responses.size(); ++i)
+                if(auto n = merged.responses[i].get())
+                    requests += "critter_requests_total{" + label_set + ",code=\"" + std::to_string(i + 1) + "xx\"} " + std::to_string(n) + "\n";
+
+            std::int64_t seen = 0;
+            std::size_t bucket = 0;
+            for(auto q: quantiles)
+            {
+                auto const rank = static_cast<std::int64_t>(q * static_cast<double>(count - 1)) + 1;
+                while(seen + merged.latency[bucket].get() < rank)
+                    seen += merged.latency[bucket++].get();
+                latencies += "critter_request_duration_seconds{" + label_set + ",quantile=\"" + format(q) + "\"} "
+                           + format(static_cast<double>(Histogram::upper_bound(bucket)) / 1e6) + "\n";
+            }
+            latencies += "critter_request_duration_seconds_sum{" + label_set + "} "
+                       + format(static_cast<double>(merged.latency_sum.get()) / 1e6) + "\n";
+            latencies += "critter_request_duration_seconds_count{" + label_set + "} " + std::to_string(count) + "\n";
+            request_bytes += "critter_request_body_bytes_total{" + label_set + "} " + std::to_string(merged.request_bytes.get()) + "\n";
+            response_bytes += "critter_response_body_bytes_total{" + label_set + "} " + std::to_string(merged.response_bytes.get()) + "\n";
+        }
+
+        std::string text;
+        auto const family = [&](const char* name, const char* type, const char* help, const std::string& samples) {
+            text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+            text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+            text += samples;
+        };
+        auto const gauge = [&](const char* name, const char* type, const char* help, Counter MetricsShard::*counter) {
+            family(name, type, help, std::string(name) + " " + std::to_string(sum([&](auto& shard) { return (shard.*counter).get(); })) + "\n");
+        };
+        family("critter_requests_total", "counter", "Requests answered, by route, method and status class.", requests);
+        family("critter_request_duration_seconds", "summary",
+               "Time from reading a request header to writing or queuing the whole response.", latencies);
+        family("critter_request_body_bytes_total", "counter", "Bytes of request bodies read.", request_bytes);
+        family("critter_response_body_bytes_total", "counter", "Bytes of response bodies written.", response_bytes);
+        gauge("critter_connections_total", "counter", "Connections accepted.", &MetricsShard::connections);
+        gauge("critter_http_sessions", "gauge", "Connections serving HTTP requests.", &MetricsShard::http_sessions);
+        gauge("critter_websocket_sessions", "gauge", "Open WebSocket sessions.", &MetricsShard::websocket_sessions);
+        gauge("critter_sse_sessions", "gauge", "Clients subscribed to event streams.", &MetricsShard::sse_sessions);
+        std::string errors;
+        for(std::size_t i = 0; i < error_stages.size(); ++i)
+            errors += std::string("critter_errors_total{stage=\"") + error_stages[i] + "\"} "
+                    + std::to_string(sum([&](auto& shard) { return shard.errors[i].get(); })) + "\n";
+        family("critter_errors_total", "counter", "Connections that failed, by stage.", errors);
+        return text;
+    }
+
+private:
+    static std::uint64_t next_id()
+    {
+        static std::atomic<std::uint64_t> ids{0};
+        return ++ids;
+    }
+
+    static std::string escape(std::string_view value)
+    {
+        std::string escaped;
+        for(char c: value)
+        {
+            if(c == '\\' || c == '"')
+                escaped += '\\';
+            if(c == '\n')
+                escaped += "\\n";
+            else
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    static std::string format(double value)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%g", value);
+        return buffer;
+    }
+
+    const std::uint64_t id_ = next_id();
+    mutable std::mutex mutex_;
+    std::vector<std::pair<std::thread::id, std::unique_ptr<MetricsShard>>> shards_;
+};
+
+}
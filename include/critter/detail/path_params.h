@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace critter
+{
+
+namespace detail { class Registry; }
+
+// Parameters captured by the route that matched a request: `{name}`
+// segments and the `(/.*)` sub-path for radix routes, regex groups for the
+// others, in pattern order. Values view into the request target and stay
+// valid as long as the request does.
+class PathParams
+{
+public:
+    static constexpr std::size_t max_size = 8;
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    std::string_view operator[](std::size_t i) const { return values_[i]; }
+
+    // Value of a `{name}` parameter, if the route declared one.
+    std::optional<std::string_view> get(std::string_view name) const
+    {
+        if(names_)
+        {
+            for(std::size_t i = 0; i < names_->size() && i < size_; ++i)
+                if((*names_)[i] == name) return values_[i];
+        }
+        return std::nullopt;
+    }
+
+    // Points the values into a copy of the target they were captured from.
+    void rebase(std::string_view from, std::string_view to)
+    {
+        for(std::size_t i = 0; i < size_; ++i)
+            values_[i] = to.substr(static_cast<std::size_t>(values_[i].data() - from.data()), values_[i].size());
+    }
+
+private:
+    friend class detail::Registry;
+
+    std::array<std::string_view, max_size> values_;
+    std::size_t size_ = 0;
+    const std::vector<std::string>* names_ = nullptr;   // empty strings for unnamed groups
+};
+
+}
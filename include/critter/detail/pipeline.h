@@ -0,0 +1,124 @@
+#pragma once
+
+#include "file_cache.h"
+#include "message.h"
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <cstddef>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace critter::detail
+{
+
+// Parses a request that is already complete in `buffer`, and consumes it.
+// Returns false, leaving the buffer alone, when it holds no request or only
+// part of one, which the next read completes, or a malformed one, which the
+// next read reports.
+template<class Parser>
+bool parse_buffered(boost::beast::flat_buffer& buffer, Parser& parser)
+{
+    boost::beast::error_code ec;
+    auto const data = buffer.data();
+    std::size_t used = 0;
+    parser.eager(true);
+    while(!parser.is_done())
+    {
+        auto const n = parser.put(data + used, ec);
+        used += n;
+        if(ec || n == 0)
+            return false;
+    }
+    buffer.consume(used);
+    return true;
+}
+
+// Responses to pipelined requests, written with a single gathered write
+// once the read buffer holds no further complete request. Only responses
+// that are entirely in memory are batched: string bodies of known length,
+// whose header is serialized into a buffer shared by the batch, and cached
+// files, which bring their own.
+class ResponseBatch
+{
+public:
+    static constexpr std::size_t max_size = 16;
+
+    bool empty() const { return entries_.empty(); }
+    std::size_t size() const { return entries_.size(); }
+
+    static bool accepts(const Response& res) { return !res.chunked(); }
+    static bool accepts(const CachedResponse&) { return true; }
+
+    void add(Response&& res, bool head_only)
+    {
+        auto const begin = heads_.size();
+        heads_ += "HTTP/";
+        heads_ += static_cast<char>('0' + res.version() / 10);
+        heads_ += '.';
+        heads_ += static_cast<char>('0' + res.version() % 10);
+        heads_ += ' ';
+        heads_ += std::to_string(res.result_int());
+        heads_ += ' ';
+        heads_.append(res.reason().data(), res.reason().size());
+        heads_ += "\r\n";
+        for(auto const& field: res)
+        {
+            heads_.append(field.name_string().data(), field.name_string().size());
+            heads_ += ": ";
+            heads_.append(field.value().data(), field.value().size());
+            heads_ += "\r\n";
+        }
+        heads_ += "\r\n";
+        entries_.push_back({std::move(res), head_only, begin, heads_.size()});
+    }
+
+    void add(CachedResponse&& res, bool head_only)
+    {
+        entries_.push_back({std::move(res), head_only, 0, 0});
+    }
+
+    // Valid until the batch is changed.
+    const std::vector<boost::asio::const_buffer>& buffers()
+    {
+        buffers_.clear();
+        for(auto& entry: entries_)
+        {
+            if(auto res = std::get_if<Response>(&entry.response))
+            {
+                buffers_.push_back(boost::asio::buffer(heads_.data() + entry.head_begin, entry.head_end - entry.head_begin));
+                if(!entry.head_only)
+                    buffers_.push_back(boost::asio::buffer(res->body().data(), res->body().size()));
+            }
+            else
+            {
+                auto const cached = std::get<CachedResponse>(entry.response).buffers();
+                buffers_.insert(buffers_.end(), cached.begin(), entry.head_only ? cached.end() - 1 : cached.end());
+            }
+        }
+        return buffers_;
+    }
+
+    void clear()
+    {
+        entries_.clear();
+        heads_.clear();
+        buffers_.clear();
+    }
+
+private:
+    struct Entry
+    {
+        std::variant<Response, CachedResponse> response;
+        bool head_only;
+        std::size_t head_begin;
+        std::size_t head_end;
+    };
+
+    std::vector<Entry> entries_;
+    std::string heads_;
+    std::vector<boost::asio::const_buffer> buffers_;
+};
+
+}
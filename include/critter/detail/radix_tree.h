@@ -0,0 +1,316 @@
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace critter::detail
+{
+
+// Pieces of the path captured while matching: `{param}` segments, then
+// the `(/.*)` sub-path, in pattern order.
+struct Captures
+{
+    static constexpr std::size_t max_size = 8;
+
+    std::array<boost::string_view, max_size> values;
+    std::size_t size = 0;
+};
+
+// A route pattern broken down into the pieces the radix tree understands.
+// Only "regular" patterns compile: literal characters (regex metacharacters
+// may be backslash-escaped), whole `{name}` segments, an optional trailing
+// slash written `/?` and a trailing `(/.*)` sub-path capture. Anything else
+// is left to std::regex.
+struct RoutePattern
+{
+    enum class Kind { literal, param, subpath };
+    struct Token
+    {
+        Kind kind;
+        std::string text;   // literal characters or parameter name
+    };
+
+    std::vector<Token> tokens;
+    bool optional_trailing_slash = false;
+
+    static std::optional<RoutePattern> compile(boost::string_view uri)
+    {
+        static const boost::string_view subpath = "(/.*)";
+        static const boost::string_view metachars = ".^$|?*+()[]{}\\";
+
+        RoutePattern pattern;
+        auto literal = [&pattern]() -> std::string& {
+            if(pattern.tokens.empty() || pattern.tokens.back().kind != Kind::literal)
+                pattern.tokens.push_back({Kind::literal, {}});
+            return pattern.tokens.back().text;
+        };
+
+        for(std::size_t i = 0; i < uri.size();)
+        {
+            const char c = uri[i];
+            if(c == '\\')
+            {
+                if(i + 1 == uri.size() || metachars.find(uri[i + 1]) == boost::string_view::npos)
+                    return std::nullopt;
+                literal() += uri[i + 1];
+                i += 2;
+            }
+            else if(c == '{')
+            {
+                // Parameters must span a whole path segment.
+                auto const close = uri.find('}', i);
+                if(close == boost::string_view::npos || close == i + 1
+                   || i == 0 || uri[i - 1] != '/'
+                   || (close + 1 != uri.size() && uri[close + 1] != '/'))
+                    return std::nullopt;
+                auto const name = uri.substr(i + 1, close - i - 1);
+                if(name.find_first_of(metachars) != boost::string_view::npos
+                   || name.find('/') != boost::string_view::npos)
+                    return std::nullopt;
+                pattern.tokens.push_back({Kind::param, name.to_string()});
+                i = close + 1;
+            }
+            else if(uri.substr(i) == subpath)
+            {
+                pattern.tokens.push_back({Kind::subpath, {}});
+                i = uri.size();
+            }
+            else if(c == '/' && uri.substr(i) == "/?")
+            {
+                pattern.optional_trailing_slash = true;
+                i = uri.size();
+            }
+            else if(metachars.find(c) != boost::string_view::npos)
+            {
+                return std::nullopt;
+            }
+            else
+            {
+                literal() += c;
+                ++i;
+            }
+        }
+        if(pattern.names().size() > Captures::max_size)
+            return std::nullopt;
+        return pattern;
+    }
+
+    // Names of the captures, empty for the sub-path.
+    std::vector<std::string> names() const
+    {
+        std::vector<std::string> names;
+        for(auto& token: tokens)
+            if(token.kind != Kind::literal)
+                names.push_back(token.text);
+        return names;
+    }
+
+    // Rewrites `{name}` segments into std::regex groups for patterns that
+    // must fall back to regex matching.
+    static std::string to_regex(boost::string_view uri)
+    {
+        std::string result;
+        result.reserve(uri.size());
+        for_each_group(uri,
+            [&](char c) { result += c; },
+            [&](boost::string_view, bool param) { if(param) result += "([^/]+)"; });
+        return result;
+    }
+
+    // Names of the groups of a regex pattern: those of `{name}` segments,
+    // empty for plain groups.
+    static std::vector<std::string> regex_names(boost::string_view uri)
+    {
+        std::vector<std::string> names;
+        for_each_group(uri,
+            [&](char) {},
+            [&](boost::string_view name, bool) { names.push_back(name.to_string()); });
+        return names;
+    }
+
+private:
+    // Calls `group(name, param)` for each capturing group of a regex
+    // pattern, `param` telling `{name}` segments (which are not passed to
+    // `character`) from plain groups, and `character(c)` for every other
+    // character.
+    template<class Character, class Group>
+    static void for_each_group(boost::string_view uri, Character&& character, Group&& group)
+    {
+        for(std::size_t i = 0; i < uri.size(); ++i)
+        {
+            if(uri[i] == '\\' && i + 1 < uri.size())
+            {
+                character(uri[i]);
+                character(uri[++i]);
+                continue;
+            }
+            if(uri[i] == '{' && i > 0 && uri[i - 1] == '/')
+            {
+                auto const close = uri.find('}', i);
+                if(close != boost::string_view::npos
+                   && (close + 1 == uri.size() || uri[close + 1] == '/')
+                   && uri.substr(i + 1, close - i - 1).find_first_of("/\\{") == boost::string_view::npos)
+                {
+                    group(uri.substr(i + 1, close - i - 1), true);
+                    i = close;
+                    continue;
+                }
+            }
+            if(uri[i] == '(' && !uri.substr(i + 1).starts_with("?"))
+                group(boost::string_view(), false);
+            character(uri[i]);
+        }
+    }
+};
+
+// Compressed prefix tree mapping compiled route patterns to route indices.
+// Matching walks the target once, preferring literal edges over `{param}`
+// segments over `(/.*)` sub-paths, and backtracks only when a preferred
+// branch dead-ends or its route is rejected by the caller. Lookups do not
+// allocate.
+class RadixTree
+{
+public:
+    // Returns the route indices stored where `pattern` ends (two positions
+    // with an optional trailing slash), creating them with `make` as needed.
+    // Patterns compiling to the same position share their route.
+    template<class Make>
+    std::vector<std::size_t> insert(const RoutePattern& pattern, Make&& make)
+    {
+        std::vector<std::size_t> routes;
+        auto value = [&](std::optional<std::size_t>& slot) {
+            if(!slot) slot = make();
+            routes.push_back(*slot);
+        };
+
+        Node* node = &root_;
+        for(auto& token: pattern.tokens)
+        {
+            switch(token.kind)
+            {
+            case RoutePattern::Kind::literal:
+                node = insert_literal(*node, token.text);
+                break;
+            case RoutePattern::Kind::param:
+                if(!node->param) node->param = std::make_unique<Node>();
+                node = node->param.get();
+                break;
+            case RoutePattern::Kind::subpath:
+                value(node->subpath);
+                return routes;
+            }
+        }
+        value(node->value);
+        if(pattern.optional_trailing_slash)
+            value(insert_literal(*node, "/")->value);
+        return routes;
+    }
+
+    // Calls `f(route, captures)` for every route matching `path`, in
+    // precedence order, until `f` returns true. Returns whether it did.
+    template<class F>
+    bool visit(boost::string_view path, F&& f) const
+    {
+        Captures captures;
+        return visit(root_, path, f, captures);
+    }
+
+    const std::size_t* find(boost::string_view path) const
+    {
+        const std::size_t* found = nullptr;
+        visit(path, [&](const std::size_t& route, const Captures&) { found = &route; return true; });
+        return found;
+    }
+
+private:
+    struct Node
+    {
+        std::string prefix;
+        std::vector<std::unique_ptr<Node>> children;   // distinct first characters
+        std::unique_ptr<Node> param;
+        std::optional<std::size_t> subpath;
+        std::optional<std::size_t> value;
+    };
+
+    static Node* insert_literal(Node& parent, boost::string_view text)
+    {
+        Node* node = &parent;
+        while(!text.empty())
+        {
+            auto child = std::find_if(node->children.begin(), node->children.end(),
+                [&](auto& c) { return c->prefix.front() == text.front(); });
+            if(child == node->children.end())
+            {
+                node->children.push_back(std::make_unique<Node>());
+                node->children.back()->prefix = text.to_string();
+                return node->children.back().get();
+            }
+
+            auto& prefix = (*child)->prefix;
+            std::size_t common = 0;
+            while(common < prefix.size() && common < text.size() && prefix[common] == text[common])
+                ++common;
+
+            if(common < prefix.size())
+            {
+                // Split the edge at the first differing character.
+                auto split = std::make_unique<Node>();
+                split->prefix = prefix.substr(0, common);
+                prefix.erase(0, common);
+                split->children.push_back(std::move(*child));
+                *child = std::move(split);
+            }
+            node = child->get();
+            text.remove_prefix(common);
+        }
+        return node;
+    }
+
+    template<class F>
+    static bool visit(const Node& node, boost::string_view path, F& f, Captures& captures)
+    {
+        if(path.empty())
+            return node.value && f(*node.value, static_cast<const Captures&>(captures));
+
+        for(auto& child: node.children)
+        {
+            if(child->prefix.front() != path.front())
+                continue;
+            if(path.starts_with(child->prefix)
+               && visit(*child, path.substr(child->prefix.size()), f, captures))
+                return true;
+            break;
+        }
+
+        if(node.param)
+        {
+            auto const end = std::min(path.find('/'), path.size());
+            if(end > 0)
+            {
+                captures.values[captures.size++] = path.substr(0, end);
+                auto const found = visit(*node.param, path.substr(end), f, captures);
+                --captures.size;
+                if(found) return true;
+            }
+        }
+
+        if(node.subpath && path.front() == '/')
+        {
+            captures.values[captures.size++] = path;
+            auto const found = f(*node.subpath, static_cast<const Captures&>(captures));
+            --captures.size;
+            return found;
+        }
+        return false;
+    }
+
+    Node root_;
+};
+
+}
@@ -1,10 +1,22 @@
+#pragma once
+
+#include "event_stream.h"
+#include "path_params.h"
+#include "radix_tree.h"
+#include "response_writer.h"
+#include "serve_files_handler.h"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <stdexcept>
 #include <vector>
 #include <tuple>
 #include <regex>
+#include <unordered_map>
 #include <variant>
 
 namespace http = boost::beast::http;
@@ -12,11 +24,11 @@ namespace http = boost::beast::http;
 namespace critter::detail
 {
 
-inline auto make_response(http::response<http::string_body>&& response) { return std::move(response); }
+inline auto make_response(Response&& response) { return std::move(response); }
 
 inline auto make_response(std::string response)
 {
-    http::response<http::string_body> res;
+    Response res;
     res.body() = std::move(response);
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
     res.set(http::field::content_type, "text/plain");
@@ -27,48 +39,312 @@ inline auto make_response(std::string response)
 inline auto make_response(const char* response) { return make_response(std::string(response)); }
 inline auto make_response(std::string_view response) { return make_response(std::string(response)); }
 
+// Completion shared by the copies of a Responder.
+struct ResponderState
+{
+    virtual ~ResponderState() = default;
+    virtual void complete(Response&& response) = 0;
+};
+
+}
+
+namespace critter
+{
+
+// Completes an asynchronous HTTP handler with anything a synchronous
+// handler may return. Call it once, from any thread; if every copy is
+// destroyed without being called, the client gets a 500 response. The
+// request and its PathParams must not be used once it was called.
+class Responder
+{
+public:
+    explicit Responder(std::shared_ptr<detail::ResponderState> state) : state_(std::move(state)) {}
+
+    template<class T>
+    void operator()(T&& response) const
+    {
+        state_->complete(detail::make_response(std::forward<T>(response)));
+    }
+
+private:
+    std::shared_ptr<detail::ResponderState> state_;
+};
+
+// Receives the body of a streamed request: `data` gets each chunk as it is
+// read, then `done` returns the response, as anything a synchronous handler
+// may return.
+struct BodyConsumer
+{
+    template<class Data, class Done>
+    BodyConsumer(Data data, Done done)
+        : data(std::move(data)),
+          done([done = std::move(done)]() mutable { return detail::make_response(done()); })
+    {
+    }
+
+    std::function<void(std::string_view)> data;
+    std::function<Response()> done;
+};
+
+}
+
+namespace critter::detail
+{
+
 class WebSocketSession;
-using HttpHandler = std::function<http::response<http::string_body>(http::request<http::string_body>&&)>;
+using HttpHandler = std::function<Response(Request&&, const PathParams&)>;
+using AsyncHttpHandler = std::function<void(Request&&, const PathParams&, Responder)>;
+using ChunkedHttpHandler = std::function<void(Request&&, const PathParams&, ResponseWriter)>;
 using WebSocketHandler = std::function<void(std::string_view, WebSocketSession&)>;
+using FileHandler = std::function<FileResponse(Request&&)>;
+
+// Routes keeping their responses open to stream the events of `channel`.
+struct SseHandler
+{
+    std::shared_ptr<EventChannel> channel;
+};
+
+// Routes whose request bodies are not buffered: `open` gets the header and
+// returns the consumer of the body, which may not exceed `body_limit`.
+struct StreamingHandler
+{
+    std::function<BodyConsumer(const RequestHeader&, const PathParams&)> open;
+    std::uint64_t body_limit;
+};
 
 class Registry
 {
-    using Handler = std::variant<HttpHandler, WebSocketHandler>;
-    using Entry = std::tuple<http::verb, std::regex, Handler>;
+    using Handler = std::variant<HttpHandler, AsyncHttpHandler, ChunkedHttpHandler, StreamingHandler, SseHandler, WebSocketHandler, FileHandler>;
+
+    static constexpr std::size_t verb_count = static_cast<std::size_t>(http::verb::unlink) + 1;
+    static_assert(verb_count <= 64, "verb masks are 64 bits wide");
+
+    // Routes are indexed by path first: a route is everything registered
+    // at one position of the radix tree (or under one regex), with its
+    // handlers indexed by verb.
+    struct Route
+    {
+        Route() { handlers.fill(-1); }
+
+        std::array<std::int32_t, verb_count> handlers;
+        std::uint64_t verbs = 0;
+        std::vector<std::string> param_names;
+    };
+
+    // Patterns that do not compile into the radix tree keep the original
+    // regex semantics, but are only consulted when registered before the
+    // best tree match, so registration order still decides between routes.
+    struct RegexRoute
+    {
+        std::size_t route;
+        std::regex regex;
+    };
 public:
 
     struct NotFound: std::out_of_range {
         NotFound(): std::out_of_range("not found") {}
     };
 
+    static std::uint64_t verb_bit(http::verb v)
+    {
+        return std::uint64_t(1) << static_cast<std::size_t>(v);
+    }
+
     void add(http::verb v, boost::beast::string_view uri, WebSocketHandler h)
     {
-        resource_table.emplace_back(std::move(v), std::regex(uri.begin(), uri.end()), Handler(h));
+        insert(v, uri, Handler(std::move(h)));
     }
 
     void add(http::verb v, boost::beast::string_view uri, HttpHandler f)
     {
-        resource_table.emplace_back(std::move(v), std::regex(uri.begin(), uri.end()), Handler(f));
+        insert(v, uri, Handler(std::move(f)));
+    }
+
+    void add(http::verb v, boost::beast::string_view uri, AsyncHttpHandler f)
+    {
+        insert(v, uri, Handler(std::move(f)));
+    }
+
+    void add(http::verb v, boost::beast::string_view uri, ChunkedHttpHandler f)
+    {
+        insert(v, uri, Handler(std::move(f)));
+    }
+
+    void add(http::verb v, boost::beast::string_view uri, StreamingHandler f)
+    {
+        insert(v, uri, Handler(std::move(f)));
+    }
+
+    void add(http::verb v, boost::beast::string_view uri, SseHandler f)
+    {
+        insert(v, uri, Handler(std::move(f)));
+    }
+
+    void add(http::verb v, boost::beast::string_view uri, FileHandler f)
+    {
+        insert(v, uri, Handler(std::move(f)));
     }
 
     const Handler& get(http::verb verb, boost::beast::string_view uri) const
     {
-        auto pred = [&](const auto& entry){
-            std::cmatch match;
-            return verb == std::get<0>(entry) 
-                && std::regex_match(uri.begin(), uri.end(), match, std::get<1>(entry));
-        };
-        auto found = 
-            std::find_if(begin(resource_table), end(resource_table), pred);
-        if (found != resource_table.end())
+        if(auto found = find(verb, uri))
         {
-            return std::get<2>(*found);
+            return *found;
         }
         throw NotFound();
     }
 
+    // Non-throwing lookup, returns nullptr when no route matches. HEAD
+    // requests fall back to the GET handler of their route.
+    const Handler* find(http::verb verb, boost::beast::string_view uri) const
+    {
+        PathParams params;
+        return find(verb, uri, params);
+    }
+
+    // Same, also filling `params` with the path parameters of the route.
+    const Handler* find(http::verb verb, boost::beast::string_view uri, PathParams& params) const
+    {
+        auto found = lookup(verb, uri, params);
+        if(!found && verb == http::verb::head)
+            found = lookup(http::verb::get, uri, params);
+        return found;
+    }
+
+    // The verbs routed for `uri`, as a mask of verb_bit()s, including the
+    // implicit HEAD and OPTIONS. Zero when no route matches the path.
+    std::uint64_t allowed_verbs(boost::beast::string_view uri) const
+    {
+        std::uint64_t verbs = 0;
+        tree_.visit(uri, [&](std::size_t route, const Captures&) {
+            verbs |= routes_[route].verbs;
+            return false;
+        });
+        for(auto& entry: regex_table_)
+        {
+            std::cmatch match;
+            if((routes_[entry.route].verbs & ~verbs) != 0
+               && std::regex_match(uri.begin(), uri.end(), match, entry.regex))
+                verbs |= routes_[entry.route].verbs;
+        }
+        if(verbs & verb_bit(http::verb::get))
+            verbs |= verb_bit(http::verb::head);
+        if(verbs)
+            verbs |= verb_bit(http::verb::options);
+        return verbs;
+    }
+
+    // Handlers are numbered in registration order.
+    std::size_t size() const { return handlers_.size(); }
+    std::size_t index(const Handler& handler) const { return static_cast<std::size_t>(&handler - handlers_.data()); }
+
+    // The route and verb a handler was registered with.
+    const std::pair<std::string, http::verb>& route_of(std::size_t index) const { return handler_routes_[index]; }
+
+    // Formats a verb mask for the Allow header.
+    static std::string allow_header(std::uint64_t verbs)
+    {
+        std::string allow;
+        for(std::size_t i = 0; i < verb_count; ++i)
+        {
+            if(!(verbs & (std::uint64_t(1) << i)))
+                continue;
+            if(!allow.empty()) allow += ", ";
+            auto const name = http::to_string(static_cast<http::verb>(i));
+            allow.append(name.data(), name.size());
+        }
+        return allow;
+    }
+
 private:
-    std::vector<Entry> resource_table;
+    const Handler* lookup(http::verb verb, boost::beast::string_view uri, PathParams& params) const
+    {
+        auto const bit = verb_bit(verb);
+        auto limit = routes_.size();
+        tree_.visit(uri, [&](std::size_t route, const Captures& captures) {
+            if(!(routes_[route].verbs & bit))
+                return false;
+            limit = route;
+            params.size_ = captures.size;
+            for(std::size_t i = 0; i < captures.size; ++i)
+                params.values_[i] = std::string_view(captures.values[i].data(), captures.values[i].size());
+            return true;
+        });
+
+        auto found = limit;
+        for(auto& entry: regex_table_)
+        {
+            if(entry.route >= limit)
+                break;
+            std::cmatch match;
+            if((routes_[entry.route].verbs & bit)
+               && std::regex_match(uri.begin(), uri.end(), match, entry.regex))
+            {
+                found = entry.route;
+                params.size_ = std::min(match.size() - 1, PathParams::max_size);
+                for(std::size_t i = 0; i < params.size_; ++i)
+                    params.values_[i] = std::string_view(match[i + 1].first, match[i + 1].length());
+                break;
+            }
+        }
+
+        if(found == routes_.size())
+        {
+            params.size_ = 0;
+            return nullptr;
+        }
+        params.names_ = &routes_[found].param_names;
+        return &handlers_[routes_[found].handlers[static_cast<std::size_t>(verb)]];
+    }
+
+    void insert(http::verb v, boost::beast::string_view uri, Handler h)
+    {
+        auto make_route = [this] {
+            routes_.emplace_back();
+            return routes_.size() - 1;
+        };
+
+        std::vector<std::size_t> routes;
+        std::vector<std::string> names;
+        if(auto pattern = RoutePattern::compile(uri))
+        {
+            routes = tree_.insert(*pattern, make_route);
+            names = pattern->names();
+        }
+        else
+        {
+            auto const re = RoutePattern::to_regex(uri);
+            auto existing = regex_routes_.find(re);
+            if(existing == regex_routes_.end())
+            {
+                existing = regex_routes_.emplace(re, make_route()).first;
+                regex_table_.push_back({existing->second, std::regex(re.begin(), re.end())});
+            }
+            routes.push_back(existing->second);
+            names = RoutePattern::regex_names(uri);
+        }
+
+        // As with a linear scan, the first handler registered for a verb wins
+        auto const slot = static_cast<std::size_t>(v);
+        for(auto route: routes)
+        {
+            if(routes_[route].handlers[slot] >= 0)
+                continue;
+            if(!routes_[route].verbs)
+                routes_[route].param_names = names;
+            routes_[route].handlers[slot] = static_cast<std::int32_t>(handlers_.size());
+            routes_[route].verbs |= verb_bit(v);
+        }
+        handlers_.push_back(std::move(h));
+        handler_routes_.emplace_back(std::string(uri.data(), uri.size()), v);
+    }
+
+    std::vector<Handler> handlers_;
+    std::vector<std::pair<std::string, http::verb>> handler_routes_;
+    std::vector<Route> routes_;
+    RadixTree tree_;
+    std::vector<RegexRoute> regex_table_;
+    std::unordered_map<std::string, std::size_t> regex_routes_;
 };
 
 }
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "coroutine.h"
+#include "message.h"
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/system/error_code.hpp>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace critter::detail
+{
+
+// Chunks written to a streamed response, handed from the writers, on any
+// thread, to the session sending them. Each write completes once its chunk
+// was sent, which is what keeps writers from outpacing the client.
+class ResponseWriterState: public std::enable_shared_from_this<ResponseWriterState>
+{
+public:
+    ResponseWriterState(boost::asio::any_io_executor executor, Response header)
+        : executor_(std::move(executor)), header_(std::move(header))
+    {
+    }
+
+    Response& header() { return header_; }
+
+    // Writer side, completes with void(error_code).
+    template<class Token>
+    auto async_write(std::string data, Token&& token)
+    {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code)>(
+            [self = shared_from_this()](auto handler, std::string data) {
+                auto done = erase_completion<boost::system::error_code>(std::move(handler), self->executor_);
+                std::unique_lock<std::mutex> lock(self->mutex_);
+                if(self->closed_)
+                {
+                    auto const ec = self->error_ ? self->error_ : boost::asio::error::operation_aborted;
+                    lock.unlock();
+                    return done(ec);
+                }
+                self->queued_.push_back({std::move(data), std::move(done)});
+                if(auto waiter = std::exchange(self->waiter_, nullptr))
+                {
+                    auto data = self->pop();
+                    lock.unlock();
+                    waiter(boost::system::error_code(), std::move(data));
+                }
+            }, token, std::move(data));
+    }
+
+    // Ends the response once the chunks already written are sent.
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        closed_ = true;
+        if(auto waiter = std::exchange(waiter_, nullptr))
+        {
+            lock.unlock();
+            waiter(boost::asio::error::eof, std::string());
+        }
+    }
+
+    // Session side: completes with void(error_code, std::string) and the
+    // next chunk, or eof once the response is closed and every chunk sent.
+    template<class Token>
+    auto async_next(Token&& token)
+    {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, std::string)>(
+            [self = shared_from_this()](auto handler) {
+                auto next = erase_completion<boost::system::error_code, std::string>(std::move(handler), self->executor_);
+                std::unique_lock<std::mutex> lock(self->mutex_);
+                if(self->queued_.empty() && !self->closed_)
+                    return void(self->waiter_ = std::move(next));
+                if(self->queued_.empty())
+                {
+                    lock.unlock();
+                    return next(boost::asio::error::eof, std::string());
+                }
+                auto data = self->pop();
+                lock.unlock();
+                next(boost::system::error_code(), std::move(data));
+            }, token);
+    }
+
+    // Completes the write of the chunk last given by async_next.
+    void written(boost::system::error_code ec)
+    {
+        std::function<void(boost::system::error_code)> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done = std::exchange(sending_, nullptr);
+        }
+        if(done)
+            done(ec);
+    }
+
+    // The response cannot be sent any further: pending and later writes
+    // complete with `ec`.
+    void abort(boost::system::error_code ec)
+    {
+        std::deque<Chunk> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            error_ = ec;
+            dropped.swap(queued_);
+        }
+        written(ec);
+        for(auto& chunk: dropped)
+            chunk.done(ec);
+    }
+
+private:
+    struct Chunk
+    {
+        std::string data;
+        std::function<void(boost::system::error_code)> done;
+    };
+
+    // Called with the mutex held.
+    std::string pop()
+    {
+        auto chunk = std::move(queued_.front());
+        queued_.pop_front();
+        sending_ = std::move(chunk.done);
+        return std::move(chunk.data);
+    }
+
+    boost::asio::any_io_executor executor_;
+    Response header_;
+    std::mutex mutex_;
+    std::deque<Chunk> queued_;
+    std::function<void(boost::system::error_code)> sending_;
+    std::function<void(boost::system::error_code, std::string)> waiter_;
+    boost::system::error_code error_;
+    bool closed_ = false;
+};
+
+}
+
+namespace critter
+{
+
+// Writes the body of a streamed response, sent with chunked transfer
+// encoding as it is written. Copies share the response, which ends when
+// close() is called or every copy is destroyed. Writes may come from any
+// thread; each completes once its chunk is sent, or fails once the
+// connection did, and writers should wait for that before writing more.
+class ResponseWriter
+{
+public:
+    explicit ResponseWriter(std::shared_ptr<detail::ResponseWriterState> state)
+        : link_(std::make_shared<Link>())
+    {
+        link_->state = std::move(state);
+    }
+
+    // 200 text/plain by default. Sent when the handler returns, and not to
+    // be used afterwards.
+    Response& header() const { return link_->state->header(); }
+
+    // Completes with void(error_code): a callback, or a token such as
+    // boost::asio::use_future from a thread that may block.
+    template<class Token>
+    auto async_write(std::string data, Token&& token) const
+    {
+        return link_->state->async_write(std::move(data), std::forward<Token>(token));
+    }
+
+    void close() const { link_->state->close(); }
+
+private:
+    struct Link
+    {
+        std::shared_ptr<detail::ResponseWriterState> state;
+        ~Link() { if(state) state->close(); }
+    };
+
+    std::shared_ptr<Link> link_;
+};
+
+}
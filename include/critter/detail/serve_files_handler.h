@@ -13,6 +13,12 @@
 //
 //------------------------------------------------------------------------------
 
+#pragma once
+
+#include "file_body.h"
+#include "file_cache.h"
+#include "compression.h"
+#include "message.h"
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
@@ -21,8 +27,15 @@
 #include <memory>
 #include <string>
 #include <thread>
-#include <fstream>
-#include <regex>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace critter::detail
 {
@@ -30,7 +43,13 @@ namespace critter::detail
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 namespace http = boost::beast::http;    // from <boost/beast/http.hpp>
 
-const auto MAX_FILE_SIZE = 4 * 1024 * 1024;
+// Static files are streamed from disk or served from the FileCache; errors
+// are plain string responses.
+using FileBodyResponse = http::response<FileBody, http::basic_fields<MessageAllocator>>;
+using FileResponse = std::variant<
+    Response,
+    FileBodyResponse,
+    CachedResponse>;
 
 //------------------------------------------------------------------------------
 
@@ -97,18 +116,297 @@ path_cat(
     return result;
 }
 
-// This function produces an HTTP response for the given request. 
-inline http::response<http::string_body>
+// Format a time as an HTTP-date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+inline std::string
+http_date(std::time_t t)
+{
+    std::tm tm;
+#if BOOST_MSVC
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    char buf[32];
+    auto const n = std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return std::string(buf, n);
+}
+
+// Strong validator derived from the file's inode, size and mtime.
+inline std::string
+file_etag(const FileInfo& info)
+{
+    char buf[64];
+    auto const n = std::snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+        static_cast<unsigned long long>(info.inode),
+        static_cast<unsigned long long>(info.size),
+        static_cast<unsigned long long>(info.mtime));
+    return std::string(buf, n);
+}
+
+// Parse an IMF-fixdate, the only HTTP-date format senders may generate.
+inline std::optional<std::time_t>
+parse_http_date(boost::beast::string_view text)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char month[4] = {};
+    int day, year, hour, minute, second;
+    std::string str = text.to_string();
+    if(std::sscanf(str.c_str(), "%*3s, %2d %3s %4d %2d:%2d:%2d GMT",
+                   &day, month, &year, &hour, &minute, &second) != 6)
+        return std::nullopt;
+    auto const m = boost::beast::string_view(months).find(month);
+    if(m == boost::beast::string_view::npos || m % 3 != 0)
+        return std::nullopt;
+
+    // Days since the epoch of a proleptic Gregorian date (H. Hinnant)
+    int y = year;
+    unsigned const mon = static_cast<unsigned>(m / 3 + 1);
+    y -= mon <= 2;
+    int const era = (y >= 0 ? y : y - 399) / 400;
+    unsigned const yoe = static_cast<unsigned>(y - era * 400);
+    unsigned const doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    unsigned const doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long long const days = era * 146097LL + static_cast<long long>(doe) - 719468;
+    return static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
+// Whether an If-None-Match list names `etag`, using the weak comparison.
+inline bool
+etag_list_matches(boost::beast::string_view list, boost::beast::string_view etag)
+{
+    if(list == "*") return true;
+    while(!list.empty())
+    {
+        auto const end = std::min(list.find(','), list.size());
+        auto tag = list.substr(0, end);
+        list.remove_prefix(std::min(end + 1, list.size()));
+        while(!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+        while(!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+        if(tag.starts_with("W/")) tag.remove_prefix(2);
+        if(tag == etag) return true;
+    }
+    return false;
+}
+
+// Parse a Range header against a file of the given size. Returns nothing
+// when the header should be ignored (not a valid bytes range set), and an
+// empty list when no range is satisfiable.
+inline std::optional<std::vector<std::pair<std::uint64_t, std::uint64_t>>>
+parse_byte_ranges(boost::beast::string_view header, std::uint64_t size)
+{
+    const std::size_t max_ranges = 16;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges;   // (offset, length)
+    if(!header.starts_with("bytes="))
+        return std::nullopt;
+    header.remove_prefix(6);
+
+    auto number = [](boost::beast::string_view digits) -> std::optional<std::uint64_t> {
+        if(digits.empty() || digits.size() > 19) return std::nullopt;
+        std::uint64_t value = 0;
+        for(char c: digits)
+        {
+            if(c < '0' || c > '9') return std::nullopt;
+            value = value * 10 + static_cast<std::uint64_t>(c - '0');
+        }
+        return value;
+    };
+
+    std::size_t specs = 0;
+    while(!header.empty())
+    {
+        auto const end = std::min(header.find(','), header.size());
+        auto spec = header.substr(0, end);
+        header.remove_prefix(std::min(end + 1, header.size()));
+        while(!spec.empty() && spec.front() == ' ') spec.remove_prefix(1);
+        while(!spec.empty() && spec.back() == ' ') spec.remove_suffix(1);
+        if(spec.empty()) continue;
+        if(++specs > max_ranges) return std::nullopt;
+
+        auto const dash = spec.find('-');
+        if(dash == boost::beast::string_view::npos) return std::nullopt;
+        auto const first = spec.substr(0, dash);
+        auto const last = spec.substr(dash + 1);
+        if(first.empty())
+        {
+            // Suffix range: the last N bytes
+            auto const n = number(last);
+            if(!n) return std::nullopt;
+            if(*n > 0 && size > 0)
+                ranges.emplace_back(size - std::min(*n, size), std::min(*n, size));
+            continue;
+        }
+        auto const from = number(first);
+        if(!from) return std::nullopt;
+        std::uint64_t to = size - 1;
+        if(!last.empty())
+        {
+            auto const n = number(last);
+            if(!n || *n < *from) return std::nullopt;
+            to = std::min(*n, size - 1);
+        }
+        if(*from < size)
+            ranges.emplace_back(*from, to - *from + 1);
+    }
+    if(specs == 0) return std::nullopt;
+    return ranges;
+}
+
+// A static file mounted under a URI prefix, as set up by serve_files.
+struct FileMount
+{
+    std::string doc_root;
+    std::string prefix;                 // literal, without trailing slash
+    std::shared_ptr<FileCache> cache;   // may be null
+    bool precompressed = false;         // look for .br/.zst/.gz siblings
+    bool compress = false;              // compress into the cache on the fly
+
+    bool negotiates() const { return precompressed || compress; }
+};
+
+// The representation selected to answer a request for a file: either the
+// file itself, a precompressed sibling, or the file compressed on the fly.
+struct FileRepresentation
+{
+    std::string path;           // file holding the bytes to send
+    FileInfo info;              // of `path`
+    Encoding encoding = Encoding::identity;
+    bool compress = false;      // encode `path` on the fly
+    std::string etag;
+};
+
+// Set the representation header fields shared by every response for a
+// file, whether it is streamed or served from the cache.
+template<class Fields>
+void
+set_file_headers(
+    Fields& fields,
+    boost::beast::string_view path,
+    const FileRepresentation& rep,
+    bool vary)
+{
+    fields.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    fields.set(http::field::content_type, mime_type(path));
+    if(rep.encoding != Encoding::identity)
+        fields.set(http::field::content_encoding, coding_token(rep.encoding));
+    if(vary)
+        fields.set(http::field::vary, "Accept-Encoding");
+    fields.set(http::field::accept_ranges, "bytes");
+    fields.set(http::field::etag, rep.etag);
+    fields.set(http::field::last_modified, http_date(rep.info.mtime));
+}
+
+// Pick the representation of `path` best matching the request's
+// Accept-Encoding among those the mount can offer.
+inline FileRepresentation
+select_representation(
+    const FileMount& mount,
+    const Request& req,
+    const std::string& path,
+    const FileInfo& info)
+{
+    FileRepresentation rep{path, info};
+
+    // Ranges always apply to the identity representation
+    if(mount.negotiates() && req[http::field::range].empty())
+    {
+        auto const accept = req[http::field::accept_encoding];
+        auto const compressible = is_compressible(mime_type(path), path)
+            && mount.cache && info.size <= mount.cache->max_file_size();
+
+        // Stable sort keeps server preference among equal q-values
+        std::array<std::pair<double, const EncodingInfo*>, 3> candidates;
+        for(std::size_t i = 0; i < candidates.size(); ++i)
+            candidates[i] = {accepted_quality(accept, content_codings()[i].token), &content_codings()[i]};
+        std::stable_sort(candidates.begin(), candidates.end(),
+            [](auto& a, auto& b) { return a.first > b.first; });
+
+        for(auto [q, coding]: candidates)
+        {
+            if(q <= 0) break;
+            if(mount.precompressed)
+            {
+                std::string sibling = path + coding->extension;
+                if(auto sibling_info = stat_file(sibling.c_str()))
+                {
+                    rep = {std::move(sibling), *sibling_info, coding->encoding, false};
+                    break;
+                }
+            }
+            if(mount.compress && compressible && can_compress(coding->encoding))
+            {
+                rep.encoding = coding->encoding;
+                rep.compress = true;
+                break;
+            }
+        }
+    }
+
+    rep.etag = file_etag(rep.info);
+    if(rep.compress)
+    {
+        // Same validators as the file, but a distinct entity tag
+        rep.etag.insert(rep.etag.size() - 1, std::string("-") + coding_token(rep.encoding));
+    }
+    return rep;
+}
+
+// Read a whole file into a cache entry with its header block serialized,
+// compressing it first if the representation calls for it.
+inline std::shared_ptr<const CachedFile>
+load_cached_file(
+    std::string key,
+    boost::beast::string_view path,
+    const FileRepresentation& rep,
+    bool vary,
+    FileBody::value_type& file)
+{
+    auto cached = std::make_shared<CachedFile>();
+    cached->key = std::move(key);
+    cached->info = rep.info;
+
+    boost::beast::error_code ec;
+    cached->body.resize(file.size());
+    std::size_t read = 0;
+    while(read < cached->body.size())
+    {
+        auto const n = file.file().read(&cached->body[read], cached->body.size() - read, ec);
+        if(ec || n == 0) return nullptr;
+        read += n;
+    }
+    if(rep.compress)
+    {
+        auto compressed = compress(rep.encoding, cached->body);
+        if(!compressed) return nullptr;
+        cached->body = std::move(*compressed);
+    }
+
+    http::fields fields;
+    set_file_headers(fields, path, rep, vary);
+    fields.set(http::field::content_length, std::to_string(cached->body.size()));
+    for(auto& field: fields)
+    {
+        cached->headers.append(field.name_string().data(), field.name_string().size());
+        cached->headers += ": ";
+        cached->headers.append(field.value().data(), field.value().size());
+        cached->headers += "\r\n";
+    }
+    return cached;
+}
+
+// This function produces an HTTP response for the given request.
+// The target is expected to start with the mount's prefix, as guaranteed
+// by the route serve_files registers; the remainder is the path under
+// the mount's doc_root.
+inline FileResponse
 serve_file_from(
-    boost::beast::string_view doc_root,
-    boost::beast::string_view uri_regex,
-    http::request<http::string_body>&& req)
+    const FileMount& mount,
+    Request&& req)
 {
     // Returns a bad request response
     auto const bad_request =
     [&req](boost::beast::string_view why)
     {
-        http::response<http::string_body> res{http::status::bad_request, req.version()};
+        Response res{http::status::bad_request, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -121,7 +419,7 @@ serve_file_from(
     auto const not_found =
     [&req](boost::beast::string_view target)
     {
-        http::response<http::string_body> res{http::status::not_found, req.version()};
+        Response res{http::status::not_found, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -134,7 +432,7 @@ serve_file_from(
     auto const server_error =
     [&req](boost::beast::string_view what)
     {
-        http::response<http::string_body> res{http::status::internal_server_error, req.version()};
+        Response res{http::status::internal_server_error, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -155,39 +453,124 @@ serve_file_from(
         return bad_request("Illegal request-target");
 
     // Build the path to the requested file
-    std::regex regex(uri_regex.begin(), uri_regex.end());
-    std::cmatch m;
-    if (!std::regex_match(req.target().begin(), req.target().end(), m, regex)
-        || m.size() != 2) {
+    boost::beast::string_view const prefix = mount.prefix;
+    if(!req.target().starts_with(prefix) ||
+        req.target().size() == prefix.size() ||
+        req.target()[prefix.size()] != '/')
         return bad_request("Illegal target");
-    }
-    std::string path = path_cat(doc_root, boost::beast::string_view(m[1].first, m[1].length()));
+    std::string path = path_cat(mount.doc_root, req.target().substr(prefix.size()));
     if(req.target().back() == '/')
         path.append("index.html");
 
-    // Attempt to open the file
-    std::ifstream file(path.c_str());
-    if (!file) return not_found(req.target());
-    file.seekg(0, std::ios::end);
-    if (file.tellg() > MAX_FILE_SIZE) {
-        return server_error("file too big");
+    auto const info = stat_file(path.c_str());
+    if(!info) return not_found(req.target());
+    auto const rep = select_representation(mount, req, path, *info);
+    auto const vary = mount.negotiates();
+
+    // Conditional requests: the client's copy is still current
+    auto const if_none_match = req[http::field::if_none_match];
+    auto const if_modified_since = req[http::field::if_modified_since];
+    bool current = false;
+    if(!if_none_match.empty())
+        current = etag_list_matches(if_none_match, rep.etag);
+    else if(auto since = parse_http_date(if_modified_since))
+        current = rep.info.mtime <= *since;
+    if(current)
+    {
+        Response res{http::status::not_modified, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::etag, rep.etag);
+        res.set(http::field::last_modified, http_date(rep.info.mtime));
+        if(vary)
+            res.set(http::field::vary, "Accept-Encoding");
+        res.keep_alive(req.keep_alive());
+        return res;
+    }
+
+    // Range requests, unless If-Range says the client's copy is stale
+    std::optional<std::vector<std::pair<std::uint64_t, std::uint64_t>>> ranges;
+    auto const range = req[http::field::range];
+    auto const if_range = req[http::field::if_range];
+    if(!range.empty() && req.method() == http::verb::get &&
+       (if_range.empty() || if_range == rep.etag || if_range == http_date(rep.info.mtime)))
+        ranges = parse_byte_ranges(range, info->size);
+
+    if(ranges && ranges->empty())
+    {
+        Response res{http::status::range_not_satisfiable, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::content_range, "bytes */" + std::to_string(info->size));
+        res.keep_alive(req.keep_alive());
+        res.prepare_payload();
+        return res;
+    }
+
+    // Hot files are served from memory as long as they are unchanged
+    auto& cache = mount.cache;
+    std::string key = rep.path;
+    if(rep.compress)
+        key += std::string(":") + coding_token(rep.encoding);
+    if(cache && !ranges)
+    {
+        if(auto cached = cache->find(key, rep.info))
+            return CachedResponse(std::move(cached), req.version(), req.keep_alive());
     }
 
-    std::string str;
-    str.reserve(file.tellg());
+    // Attempt to open the file
+    boost::beast::error_code ec;
+    FileBodyResponse res{http::status::ok, req.version()};
+    res.body().open(rep.path.c_str(), ec);
+    if(ec) return not_found(req.target());
+
+    if(ranges)
+    {
+        auto content_range = [&](std::uint64_t offset, std::uint64_t length) {
+            return "bytes " + std::to_string(offset) + "-" + std::to_string(offset + length - 1)
+                + "/" + std::to_string(res.body().file_size());
+        };
 
-    file.seekg(0, std::ios::beg);
-    str.assign((std::istreambuf_iterator<char>(file)),
-                std::istreambuf_iterator<char>());
+        res.result(http::status::partial_content);
+        set_file_headers(res, path, rep, vary);
+        if(ranges->size() == 1)
+        {
+            auto const [offset, length] = ranges->front();
+            res.body().select_range(offset, length);
+            res.set(http::field::content_range, content_range(offset, length));
+        }
+        else
+        {
+            std::string const boundary = "critter-" + rep.etag.substr(1, rep.etag.size() - 2);
+            std::string const part_type = "Content-Type: " + mime_type(path).to_string() + "\r\n";
+            for(auto const [offset, length]: *ranges)
+            {
+                res.body().add_part(
+                    "\r\n--" + boundary + "\r\n" + part_type
+                    + "Content-Range: " + content_range(offset, length) + "\r\n\r\n",
+                    offset, length);
+            }
+            res.body().set_tail("\r\n--" + boundary + "--\r\n");
+            res.set(http::field::content_type, "multipart/byteranges; boundary=" + boundary);
+        }
+        res.keep_alive(req.keep_alive());
+        res.prepare_payload();
+        return res;
+    }
+
+    if(cache && (rep.compress || res.body().size() <= cache->max_file_size()))
+    {
+        if(auto cached = load_cached_file(key, path, rep, vary, res.body()))
+        {
+            cache->insert(cached);
+            return CachedResponse(std::move(cached), req.version(), req.keep_alive());
+        }
+        return server_error("read failed");
+    }
 
     // Respond to GET request
-    http::response<http::string_body> res{http::status::ok, req.version()};
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, mime_type(path));
-    res.body() = str;
+    set_file_headers(res, path, rep, vary);
     res.keep_alive(req.keep_alive());
     res.prepare_payload();
-    return std::move(res);
+    return res;
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <boost/asio/execution/context.hpp>
+#include <boost/asio/execution_context.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/query.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+namespace critter
+{
+
+// Deadlines of HTTP connections; zero disables one.
+struct TimeoutOptions
+{
+    // Reading a request header, from its first byte, and the TLS handshake
+    std::chrono::milliseconds read_header = std::chrono::seconds(30);
+    // Reading a buffered request body, or each chunk of a streamed one
+    std::chrono::milliseconds read_body = std::chrono::seconds(60);
+    // Writing with no progress
+    std::chrono::milliseconds write = std::chrono::seconds(60);
+    // Waiting for the next request on a kept-alive connection, which is
+    // then closed quietly
+    std::chrono::milliseconds idle = std::chrono::seconds(60);
+};
+
+}
+
+namespace critter::detail
+{
+
+class TimerWheel;
+
+// A timeout of a connection, armed around each of its operations: when it
+// expires, `on_expiry` runs, usually closing the socket so that the pending
+// operation fails. It runs on a thread of the io_context with the wheel
+// locked, so once expires_after(), restart() or cancel() returned, it is
+// either done or will not run.
+class Deadline
+{
+public:
+    Deadline(TimerWheel& wheel, std::function<void()> on_expiry)
+        : wheel_(wheel), on_expiry_(std::move(on_expiry))
+    {
+    }
+
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+    inline ~Deadline();
+
+    // Arms the deadline `timeout` from now, or cancels it if zero.
+    inline void expires_after(std::chrono::milliseconds timeout);
+
+    // Arms it again for the duration last given, if armed: the operation
+    // made progress.
+    inline void restart();
+
+    inline void cancel();
+
+    // Whether it expired since it was last armed.
+    bool expired() const { return expired_; }
+
+private:
+    friend class TimerWheel;
+
+    TimerWheel& wheel_;
+    std::function<void()> on_expiry_;
+    std::chrono::milliseconds timeout_{0};
+    Deadline* prev_ = nullptr;
+    Deadline* next_ = nullptr;
+    std::size_t slot_ = 0;
+    std::uint64_t rounds_ = 0;
+    bool armed_ = false;
+    bool expired_ = false;
+};
+
+// Hashed timer wheel, one per io_context: deadlines hang in slots of
+// `resolution` and a single timer visits the next slot at each tick, so
+// arming and cancelling cost O(1) however many connections there are.
+// Deadlines further than a turn of the wheel wait for their remaining
+// rounds. The timer only runs while deadlines are armed.
+class TimerWheel: public boost::asio::execution_context::service
+{
+public:
+    using key_type = TimerWheel;
+    static inline boost::asio::execution_context::id id;
+
+    static constexpr std::chrono::milliseconds resolution{100};
+    static constexpr std::size_t slot_count = 512;
+
+    explicit TimerWheel(boost::asio::execution_context& context)
+        : boost::asio::execution_context::service(context),
+          timer_(static_cast<boost::asio::io_context&>(context))
+    {
+        slots_.fill(nullptr);
+    }
+
+    void arm(Deadline& deadline, std::chrono::milliseconds timeout)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        link(deadline, timeout);
+    }
+
+    void restart(Deadline& deadline)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(deadline.armed_)
+            link(deadline, deadline.timeout_);
+    }
+
+    void cancel(Deadline& deadline)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        unlink(deadline);
+    }
+
+private:
+    void shutdown() override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        for(auto& head: slots_)
+        {
+            while(head)
+                unlink(*head);
+        }
+        boost::system::error_code ec;
+        timer_.cancel(ec);
+    }
+
+    // Called with the mutex held, as are the functions below.
+    void link(Deadline& deadline, std::chrono::milliseconds timeout)
+    {
+        unlink(deadline);
+        deadline.expired_ = false;
+        deadline.timeout_ = timeout;
+        if(timeout.count() <= 0 || stopped_)
+            return;
+
+        auto const ticks = static_cast<std::uint64_t>(std::max<std::int64_t>(1,
+            (timeout.count() + resolution.count() - 1) / resolution.count()));
+        deadline.slot_ = (current_ + ticks) % slot_count;
+        deadline.rounds_ = (ticks - 1) / slot_count;
+        deadline.armed_ = true;
+        deadline.prev_ = nullptr;
+        deadline.next_ = slots_[deadline.slot_];
+        if(deadline.next_)
+            deadline.next_->prev_ = &deadline;
+        slots_[deadline.slot_] = &deadline;
+        if(armed_++ == 0 && !ticking_)
+        {
+            ticking_ = true;
+            next_tick_ = std::chrono::steady_clock::now() + resolution;
+            wait();
+        }
+    }
+
+    void unlink(Deadline& deadline)
+    {
+        if(!deadline.armed_)
+            return;
+        if(deadline.prev_)
+            deadline.prev_->next_ = deadline.next_;
+        else
+            slots_[deadline.slot_] = deadline.next_;
+        if(deadline.next_)
+            deadline.next_->prev_ = deadline.prev_;
+        deadline.prev_ = deadline.next_ = nullptr;
+        deadline.armed_ = false;
+        --armed_;
+    }
+
+    void wait()
+    {
+        timer_.expires_at(next_tick_);
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if(!ec)
+                tick();
+        });
+    }
+
+    // Visits the slots whose time came, expiring their deadlines due this
+    // turn.
+    void tick()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto const now = std::chrono::steady_clock::now();
+        while(next_tick_ <= now && armed_ > 0)
+        {
+            current_ = (current_ + 1) % slot_count;
+            next_tick_ += resolution;
+            for(auto deadline = slots_[current_]; deadline;)
+            {
+                auto const next = deadline->next_;
+                if(deadline->rounds_ > 0)
+                {
+                    --deadline->rounds_;
+                }
+                else
+                {
+                    unlink(*deadline);
+                    deadline->expired_ = true;
+                    deadline->on_expiry_();
+                }
+                deadline = next;
+            }
+        }
+        ticking_ = armed_ > 0 && !stopped_;
+        if(ticking_)
+            wait();
+    }
+
+    boost::asio::steady_timer timer_;
+    std::mutex mutex_;
+    std::array<Deadline*, slot_count> slots_;
+    std::size_t current_ = 0;
+    std::size_t armed_ = 0;
+    std::chrono::steady_clock::time_point next_tick_;
+    bool ticking_ = false;
+    bool stopped_ = false;
+};
+
+Deadline::~Deadline() { cancel(); }
+void Deadline::expires_after(std::chrono::milliseconds timeout) { wheel_.arm(*this, timeout); }
+void Deadline::restart() { wheel_.restart(*this); }
+void Deadline::cancel() { wheel_.cancel(*this); }
+
+// The wheel of the io_context running `executor`.
+template<class Executor>
+TimerWheel& timer_wheel(const Executor& executor)
+{
+    return boost::asio::use_service<TimerWheel>(boost::asio::query(executor, boost::asio::execution::context));
+}
+
+}
@@ -1,8 +1,45 @@
+#pragma once
+
+#include "coroutine.h"
+#include "path_params.h"
+#include "timer_wheel.h"
+#include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
-#include <boost/asio/spawn.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/post.hpp>
+#include <chrono>
+#include <deque>
 #include <memory>
+#include <optional>
 #include <iostream>
+#include <string>
+
+
+namespace critter
+{
 
+// What a WebSocket session does when a consumer falls behind and its
+// outbound queue reaches WebSocketOptions::max_queued_messages.
+enum class SlowConsumerPolicy
+{
+    drop_oldest,    // discard the oldest message not yet being written
+    drop_newest,    // discard the message being sent
+    disconnect      // close the connection
+};
+
+struct WebSocketOptions
+{
+    std::size_t max_queued_messages = 1024;
+    SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::drop_oldest;
+    // Closes sessions receiving neither a message nor a control frame for
+    // that long; zero keeps them open.
+    std::chrono::milliseconds idle_timeout{0};
+    // Closes sessions whose handshake or message took that long to write;
+    // zero waits forever.
+    std::chrono::milliseconds write_timeout = std::chrono::seconds(60);
+};
+
+}
 
 namespace critter::detail
 {
@@ -10,10 +47,38 @@ namespace critter::detail
 namespace http = boost::beast::http;
 namespace websocket = boost::beast::websocket;
 
+// Upgrade requests outlive the exchange, and so the connection's arena:
+// sessions keep a heap-allocated copy of their header.
+inline http::request<http::string_body> detach(http::request<http::string_body>&& req)
+{
+    return std::move(req);
+}
+
+template<class Body, class Allocator>
+http::request<http::string_body> detach(http::request<Body, http::basic_fields<Allocator>>&& req)
+{
+    http::request<http::string_body> copy;
+    copy.method_string(req.method_string());
+    copy.target(req.target());
+    copy.version(req.version());
+    for(auto const& field: req)
+        copy.insert(field.name_string(), field.value());
+    return copy;
+}
+
 class WebSocketSession
 {
 public:
+    // Queue a text message; it is written asynchronously, in order, by the
+    // session's writer. Safe to call from any thread.
     virtual void send(std::string_view msg)=0;
+
+    // Queue a message shared with other sessions, as done by broadcasts:
+    // the payload is referenced, never copied.
+    virtual void send(std::shared_ptr<const std::string> msg)=0;
+
+    // Path parameters of the upgrade request.
+    virtual const PathParams& params() const=0;
 };
 
 template<class StreamClass>
@@ -21,33 +86,57 @@ class WebSocketSessionImpl : public WebSocketSession, public std::enable_shared_
 {
 public:
     template<class F>
-    WebSocketSessionImpl(StreamClass stream, F f)
-        : ws_(std::move(stream)), on_message_(std::move(f))
+    WebSocketSessionImpl(StreamClass stream, F f, const WebSocketOptions& options, const Spawner& spawn,
+                         boost::beast::string_view target, const PathParams& params)
+        : ws_(std::move(stream)), on_message_(std::move(f)),
+          strand_(boost::asio::make_strand(ws_.get_executor())), options_(options), spawn_(spawn),
+          target_(target.data(), target.size()), params_(params)
+    {
+        params_.rebase(std::string_view(target.data(), target.size()), target_);
+    }
+
+    virtual const PathParams& params() const override
     {
+        return params_;
     }
 
     virtual void send(std::string_view msg) override
     {
-        boost::beast::multi_buffer buffer;
-        boost::beast::ostream(buffer) << msg;
-        ws_.text(true);
-        ws_.write(buffer.data());
+        send(std::make_shared<const std::string>(msg));
+    }
+
+    virtual void send(std::shared_ptr<const std::string> msg) override
+    {
+        boost::asio::post(strand_,
+            [self = this->shared_from_this(), msg = std::move(msg)]() mutable {
+                self->enqueue(std::move(msg));
+            });
     }
 
     void
-    run(http::request<http::string_body> req,
-        boost::asio::yield_context yield)
+    run(http::request<http::string_body> req)
     {
-        // Accept the websocket handshake
-        boost::system::error_code ec;
-        ws_.async_accept(req, yield[ec]);
-        if(ec) throw std::system_error(ec, "ws accept failed");
-
-        boost::asio::spawn(
-            ws_.get_executor(),
-            std::bind(
-                &WebSocketSessionImpl::read, this->shared_from_this(),
-                std::placeholders::_1)); 
+        // Deadlines close the session on its strand; they do not keep it
+        // alive.
+        auto const expire = [weak = this->weak_from_this(), strand = strand_] {
+            boost::asio::post(strand, [weak] {
+                if(auto self = weak.lock())
+                    self->close();
+            });
+        };
+        auto& wheel = timer_wheel(ws_.get_executor());
+        read_deadline_.emplace(wheel, expire);
+        write_deadline_.emplace(wheel, expire);
+        ws_.control_callback([this](websocket::frame_type, boost::beast::string_view) {
+            read_deadline_->restart();
+        });
+
+        // Accept the handshake and read messages on the session's strand,
+        // which also serializes the writer and every access to the queue.
+        spawn_(strand_,
+            [self = this->shared_from_this(), req = std::move(req)](auto yield) mutable {
+                return self->read(std::move(req), yield);
+            });
     }
 
     template<class F>
@@ -60,29 +149,131 @@ private:
 
     using MessageHandler = std::function<void(std::string_view, WebSocketSession&)>;
     using OnCloseHandler = std::function<void(std::shared_ptr<WebSocketSession>)>;
+    using Message = std::shared_ptr<const std::string>;
 
     websocket::stream<StreamClass> ws_;
     MessageHandler on_message_;
     OnCloseHandler on_close_ = [](auto){};
+    boost::asio::strand<typename websocket::stream<StreamClass>::executor_type> strand_;
+    WebSocketOptions options_;
+    Spawner spawn_;
+    std::string target_;
+    PathParams params_;
+    std::deque<Message> queue_;
+    bool open_ = false;
+    bool writing_ = false;
+    bool closed_ = false;
+    std::optional<Deadline> read_deadline_;
+    std::optional<Deadline> write_deadline_;
 
     void fail(boost::system::error_code ec, char const* what)
     {
         std::cerr << what << ": " << ec.message() << "\n";
     }
 
-    void
-    read(boost::asio::yield_context yield)
+    void fail(const Deadline& deadline, boost::system::error_code ec, char const* what)
     {
-        for(;;)
+        if(deadline.expired())
+            fail(boost::asio::error::timed_out, "timeout");
+        else
+            fail(ec, what);
+    }
+
+    void enqueue(Message msg)
+    {
+        if(closed_) return;
+        if(queue_.size() >= options_.max_queued_messages)
+        {
+            switch(options_.slow_consumer_policy)
+            {
+            case SlowConsumerPolicy::drop_newest:
+                return;
+            case SlowConsumerPolicy::drop_oldest:
+                // The front message may be in the middle of being written
+                if(queue_.size() > (writing_ ? 1u : 0u))
+                    queue_.erase(queue_.begin() + (writing_ ? 1 : 0));
+                else
+                    return;
+                break;
+            case SlowConsumerPolicy::disconnect:
+                return close();
+            }
+        }
+        queue_.push_back(std::move(msg));
+        start_writing();
+    }
+
+    void start_writing()
+    {
+        if(!open_ || writing_ || queue_.empty()) return;
+        writing_ = true;
+        spawn_(strand_,
+            [self = this->shared_from_this()](auto yield) {
+                return self->write(yield);
+            });
+    }
+
+    void close()
+    {
+        // Tear the connection down; the pending read fails and reports it.
+        closed_ = true;
+        queue_.clear();
+        boost::system::error_code ec;
+        boost::beast::get_lowest_layer(ws_).close(ec);
+    }
+
+    Task
+    write(Yield yield)
+    {
+        while(!queue_.empty())
         {
             boost::system::error_code ec;
+            auto msg = queue_.front();
+            ws_.text(true);
+            write_deadline_->expires_after(options_.write_timeout);
+            CRITTER_AWAIT ws_.async_write(boost::asio::buffer(*msg), yield[ec]);
+            write_deadline_->cancel();
+            if(ec) {
+                writing_ = false;
+                close();
+                CRITTER_CO_RETURN fail(*write_deadline_, ec, "write");
+            }
+            if(closed_) break;
+            queue_.pop_front();
+        }
+        writing_ = false;
+    }
+
+    Task
+    read(http::request<http::string_body> req,
+        Yield yield)
+    {
+        // Accept the websocket handshake
+        boost::system::error_code ec;
+        write_deadline_->expires_after(options_.write_timeout);
+        CRITTER_AWAIT ws_.async_accept(req, yield[ec]);
+        write_deadline_->cancel();
+        if(ec) {
+            closed_ = true;
+            on_close_(this->shared_from_this());
+            CRITTER_CO_RETURN fail(*write_deadline_, ec, "ws accept");
+        }
+        open_ = true;
+        start_writing();
+
+        for(;;)
+        {
             boost::beast::multi_buffer buffer;
 
             // Read a message into our buffer
-            ws_.async_read(buffer, yield[ec]);
+            read_deadline_->expires_after(options_.idle_timeout);
+            CRITTER_AWAIT ws_.async_read(buffer, yield[ec]);
+            read_deadline_->cancel();
             if(ec) {
+                closed_ = true;
+                queue_.clear();
                 on_close_(this->shared_from_this());
-                return fail(ec, "read");
+                CRITTER_CO_RETURN fail(*read_deadline_, ec, "read");
             }
 
             on_message_(boost::beast::buffers_to_string(buffer.data()), *this);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+namespace critter
+{
+
+// Threads running the handlers registered with add_offloaded_http_handler,
+// away from the I/O threads.
+struct WorkerPoolOptions
+{
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    // Requests waiting for or running on a worker, beyond which offloaded
+    // routes answer 503 Service Unavailable.
+    std::size_t max_pending = 1024;
+};
+
+}
+
+namespace critter::detail
+{
+
+class WorkerPool
+{
+public:
+    explicit WorkerPool(const WorkerPoolOptions& options)
+        : pool_(std::max(options.threads, 1u)), max_pending_(options.max_pending)
+    {
+    }
+
+    // Runs `f` on a worker, unless the pool is saturated.
+    template<class F>
+    bool try_post(F&& f)
+    {
+        if(pending_.fetch_add(1, std::memory_order_relaxed) >= max_pending_)
+        {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        boost::asio::post(pool_, [this, f = std::forward<F>(f)]() mutable {
+            f();
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+        });
+        return true;
+    }
+
+    // Waits for the jobs already posted.
+    void join()
+    {
+        pool_.join();
+    }
+
+private:
+    boost::asio::thread_pool pool_;
+    const std::size_t max_pending_;
+    std::atomic<std::size_t> pending_{0};
+};
+
+}
@@ -2,9 +2,18 @@
 
 #define BOOST_COROUTINES_NO_DEPRECATION_WARNING
 
+#include "detail/arena.h"
+#include "detail/coroutine.h"
+#include "detail/event_stream.h"
+#include "detail/message.h"
+#include "detail/metrics.h"
+#include "detail/pipeline.h"
 #include "detail/registry.h"
+#include "detail/response_writer.h"
 #include "detail/serve_files_handler.h"
+#include "detail/timer_wheel.h"
 #include "detail/websocket_session.h"
+#include "detail/worker_pool.h"
 #include <boost/beast/websocket.hpp>
 #if BOOST_VERSION < 107000
 #   include <boost/beast/experimental/core/ssl_stream.hpp>
@@ -13,14 +22,18 @@
 #endif
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/ip/tcp.hpp>
-#include <boost/asio/spawn.hpp>
 #include <boost/system/system_error.hpp>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <limits>
 #include <memory>
 #include <string>
 #include <thread>
 #include <vector>
 #include <mutex>
+#include <optional>
 #include <stdexcept>
 
 namespace critter
@@ -41,15 +54,26 @@ private:
     std::string message;
 };
 
-using Request=http::request<http::string_body>;
-using Response=http::response<http::string_body>;
-
 struct SslOptions
 {
     std::string certificate_file_path;
     std::string key_file_path;
 };
 
+struct StaticFileOptions
+{
+    // Bytes of file content kept in memory per mount; 0 disables caching.
+    std::size_t cache_size = 0;
+    // Larger files are always streamed from disk.
+    std::size_t max_cached_file_size = 256 * 1024;
+    // Serve `file.br`, `file.zst` or `file.gz` instead of `file` to clients
+    // accepting that encoding.
+    bool precompressed = false;
+    // Compress text files into the cache for clients accepting gzip
+    // (CRITTER_WITH_ZLIB) or br (CRITTER_WITH_BROTLI); needs cache_size.
+    bool compress = false;
+};
+
 class WebServer
 {
     using tcp = boost::asio::ip::tcp;
@@ -72,12 +96,8 @@ public:
     void listen(unsigned short port=80)
     {
         auto const address = boost::asio::ip::address::from_string("::");
-        boost::asio::spawn(ioc,
-            std::bind(
-                &WebServer::do_listen<tcp::socket>, this,
-                std::ref(ioc),
-                tcp::endpoint{address, port},
-                std::placeholders::_1));
+        listeners_.push_back({tcp::endpoint{address, port}, false});
+        spawn_listener(ioc, listeners_.back(), false);
     }
 
     void listen(const SslOptions& options, unsigned short port=443)
@@ -90,12 +110,8 @@ public:
         ctx.use_private_key_file(options.key_file_path, boost::asio::ssl::context_base::pem);
 
         auto const address = boost::asio::ip::address::from_string("::");
-        boost::asio::spawn(ioc,
-            std::bind(
-                &WebServer::do_listen<boost::beast::ssl_stream<tcp::socket>>, this,
-                std::ref(ioc),
-                tcp::endpoint{address, port},
-                std::placeholders::_1));
+        listeners_.push_back({tcp::endpoint{address, port}, true});
+        spawn_listener(ioc, listeners_.back(), false);
     }
 
     ~WebServer()
@@ -104,26 +120,189 @@ public:
         std::for_each(begin(threads), end(threads), [](auto& t) {t.join();});
     }
 
-    void serve_files(std::string base_uri, boost::beast::string_view local_path)
+    void serve_files(std::string base_uri, boost::beast::string_view local_path,
+                     const StaticFileOptions& options = StaticFileOptions())
     {
-        if(base_uri.back() == '/') base_uri.resize(base_uri.size() - 1);
-        base_uri += "(/.*)";
-        std::string path = local_path.to_string();
-        registry_.add(http::verb::get, base_uri,
-            [=](http::request<http::string_body>&& req) -> http::response<http::string_body> {
-                return detail::serve_file_from(path, base_uri, std::move(req));
-            });
+        if(!base_uri.empty() && base_uri.back() == '/') base_uri.resize(base_uri.size() - 1);
+
+        // The mount point is taken literally so the route compiles into the
+        // radix tree and the handler only has to strip it off the target.
+        std::string uri_regex;
+        for(char c: base_uri)
+        {
+            if(std::strchr(".^$|?*+()[]{}\\", c)) uri_regex += '\\';
+            uri_regex += c;
+        }
+        uri_regex += "(/.*)";
+
+        auto mount = std::make_shared<detail::FileMount>();
+        mount->doc_root = local_path.to_string();
+        mount->prefix = base_uri;
+        if(options.cache_size > 0)
+            mount->cache = std::make_shared<detail::FileCache>(options.cache_size, options.max_cached_file_size);
+        mount->precompressed = options.precompressed;
+        mount->compress = options.compress;
+
+        registry_.add(http::verb::get, uri_regex,
+            detail::FileHandler([mount](Request&& req) {
+                return detail::serve_file_from(*mount, std::move(req));
+            }));
     }
 
+    // Handlers take the request and, optionally, the route's PathParams.
     template<class F>
     void add_http_handler(http::verb v, boost::beast::string_view uri_regex, F&& f)
     {
-        registry_.add(v, uri_regex, [f=std::move(f)] (auto&& r) {return detail::make_response(f(std::move(r)));});
+        registry_.add(v, uri_regex, make_http_handler(std::forward<F>(f)));
+    }
+
+    // Handlers take the request, optionally the route's PathParams, and a
+    // Responder to call with the response once it is ready, possibly from
+    // another thread; the connection waits for it meanwhile.
+    template<class F>
+    void add_async_http_handler(http::verb v, boost::beast::string_view uri_regex, F&& f)
+    {
+        if constexpr (std::is_invocable_v<F&, Request&&, const PathParams&, Responder>)
+        {
+            registry_.add(v, uri_regex, detail::AsyncHttpHandler(std::forward<F>(f)));
+        }
+        else
+        {
+            registry_.add(v, uri_regex, detail::AsyncHttpHandler(
+                [f=std::move(f)] (Request&& r, const PathParams&, Responder respond) {f(std::move(r), std::move(respond));}));
+        }
+    }
+
+    // Handlers take the request, optionally the route's PathParams, and a
+    // ResponseWriter: the response header is sent when they return, then
+    // its body as they write it, possibly from another thread, in chunks.
+    template<class F>
+    void add_chunked_http_handler(http::verb v, boost::beast::string_view uri_regex, F&& f)
+    {
+        if constexpr (std::is_invocable_v<F&, Request&&, const PathParams&, ResponseWriter>)
+        {
+            registry_.add(v, uri_regex, detail::ChunkedHttpHandler(std::forward<F>(f)));
+        }
+        else
+        {
+            registry_.add(v, uri_regex, detail::ChunkedHttpHandler(
+                [f=std::move(f)] (Request&& r, const PathParams&, ResponseWriter writer) {f(std::move(r), std::move(writer));}));
+        }
     }
 
-    void add_ws_handler(boost::beast::string_view uri_regex, detail::WebSocketHandler f)
+    // Handlers as for add_http_handler, run on the worker pool so that they
+    // can block or compute without stalling the other connections of their
+    // I/O thread. Requests beyond the pool's capacity get a 503.
+    template<class F>
+    void add_offloaded_http_handler(http::verb v, boost::beast::string_view uri_regex, F&& f)
     {
-        registry_.add(http::verb::get, uri_regex, std::move(f));
+        if(!workers_)
+            set_worker_pool(WorkerPoolOptions());
+        registry_.add(v, uri_regex, detail::AsyncHttpHandler(
+            [this, handler = make_http_handler(std::forward<F>(f))]
+            (Request&& req, const PathParams& params, Responder respond) {
+                auto const version = req.version();
+                auto const keep_alive = req.keep_alive();
+                auto job = [this, &handler, req = std::move(req), params, respond]() mutable {
+                    respond(invoke(handler, std::move(req), params));
+                };
+                if(!workers_->try_post(std::move(job)))
+                    respond(exception_response(version, keep_alive,
+                        HttpException(http::status::service_unavailable, "The server is busy.")));
+            }));
+    }
+
+    // Handlers for request bodies too large to buffer: `f` takes the request
+    // header and, optionally, the route's PathParams, and returns the
+    // BodyConsumer the body is then fed to as it is read. Longer bodies
+    // than `body_limit` get a 413.
+    template<class F>
+    void add_streaming_http_handler(http::verb v, boost::beast::string_view uri_regex, F&& f,
+                                    std::uint64_t body_limit = std::numeric_limits<std::uint64_t>::max())
+    {
+        if constexpr (std::is_invocable_v<F&, const RequestHeader&, const PathParams&>)
+        {
+            registry_.add(v, uri_regex, detail::StreamingHandler{std::forward<F>(f), body_limit});
+        }
+        else
+        {
+            registry_.add(v, uri_regex, detail::StreamingHandler{
+                [f=std::move(f)] (const RequestHeader& h, const PathParams&) {return f(h);}, body_limit});
+        }
+    }
+
+    // Clients of `uri_regex` subscribe to `channel` with a GET request, and
+    // get its events as Server-Sent Events until they disconnect.
+    void add_sse_handler(boost::beast::string_view uri_regex, std::shared_ptr<EventChannel> channel)
+    {
+        registry_.add(http::verb::get, uri_regex, detail::SseHandler{std::move(channel)});
+    }
+
+    // Serves the metrics recorded so far at `uri_regex`, in the Prometheus
+    // text format.
+    void add_metrics_handler(boost::beast::string_view uri_regex)
+    {
+        add_http_handler(http::verb::get, uri_regex, [this](auto&&) {
+            auto res = detail::make_response(metrics());
+            res.set(http::field::content_type, "text/plain; version=0.0.4");
+            return res;
+        });
+    }
+
+    // Per route request counts, latency percentiles and body bytes, active
+    // sessions and connection errors, in the Prometheus text format. Each
+    // thread records its own, lock-free; they are summed here.
+    std::string metrics() const
+    {
+        return metrics_.prometheus(registry_.size() + 1, [this](std::size_t slot) {
+            auto const& route = registry_.route_of(slot - 1);
+            auto const method = http::to_string(route.second);
+            return std::make_pair(route.first, std::string(method.data(), method.size()));
+        });
+    }
+
+    // Replaces the worker pool of offloaded handlers, which otherwise gets
+    // the default options; call before start().
+    void set_worker_pool(const WorkerPoolOptions& options)
+    {
+        workers_ = std::make_unique<detail::WorkerPool>(options);
+    }
+
+    // Handlers take each message, the session and, optionally, the
+    // PathParams of the upgrade request (also available from the session).
+    template<class F>
+    void add_ws_handler(boost::beast::string_view uri_regex, F&& f)
+    {
+        if constexpr (std::is_invocable_v<F&, std::string_view, detail::WebSocketSession&, const PathParams&>)
+        {
+            registry_.add(http::verb::get, uri_regex, detail::WebSocketHandler(
+                [f=std::move(f)] (std::string_view msg, detail::WebSocketSession& session) {
+                    f(msg, session, session.params());
+                }));
+        }
+        else
+        {
+            registry_.add(http::verb::get, uri_regex, detail::WebSocketHandler(std::move(f)));
+        }
+    }
+
+    // Applies to WebSocket sessions accepted from now on.
+    void set_ws_options(const WebSocketOptions& options)
+    {
+        ws_options_ = options;
+    }
+
+    // Applies to the operations of connections started from now on; call
+    // before start().
+    void set_timeouts(const TimeoutOptions& options)
+    {
+        timeouts_ = options;
+    }
+
+    // Applies to coroutines spawned from now on; call before start().
+    void set_coroutine_options(const CoroutineOptions& options)
+    {
+        spawn_ = detail::Spawner(options);
     }
 
     void start(unsigned nb_threads=1)
@@ -137,12 +316,66 @@ public:
         }
     }
 
+    // Alternative to start() and run(): each thread runs its own io_context
+    // with its own SO_REUSEPORT acceptor for every listen() call, so the
+    // kernel spreads connections across threads and each connection stays
+    // on the thread that accepted it. Threads are optionally pinned to CPUs
+    // 0..nb_threads-1 (Linux only).
+    void start_per_core(unsigned nb_threads=std::thread::hardware_concurrency(), bool pin_threads=false)
+    {
+        nb_threads = std::max(nb_threads, 1u);
+        for(unsigned i = 0; i < nb_threads; ++i)
+        {
+            auto& context = *core_iocs.emplace_back(std::make_unique<boost::asio::io_context>(1));
+            for(auto& listener: listeners_)
+                spawn_listener(context, listener, true);
+        }
+        for(unsigned i = 0; i < nb_threads; ++i)
+        {
+            threads.emplace_back([this, i, pin_threads]
+            {
+#if defined(__linux__)
+                if(pin_threads)
+                {
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET(i % CPU_SETSIZE, &cpus);
+                    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+                }
+#endif
+                core_iocs[i]->run();
+            });
+        }
+    }
+
     WebSocketSessions get_ws_sessions() const
     {
         std::lock_guard<std::mutex> lock(mutex_);
         return ws_sessions_;
     }
 
+    // Send a text message to every WebSocket session accepted by `filter`.
+    // The payload is copied once and shared by all the sessions' queues;
+    // server frames are unmasked and uncompressed, so each writer only adds
+    // its own frame header in front of the shared bytes. The filter runs
+    // under the sessions lock and must not call back into the server.
+    template<class Filter>
+    void broadcast(std::string_view message, Filter&& filter)
+    {
+        auto const shared = std::make_shared<const std::string>(message);
+        std::lock_guard<std::mutex> lock(mutex_);
+        for(auto& session: ws_sessions_)
+        {
+            if(filter(*session))
+                session->send(shared);
+        }
+    }
+
+    void broadcast(std::string_view message)
+    {
+        broadcast(message, [](const detail::WebSocketSession&) { return true; });
+    }
+
     void run()
     {
         ioc.run();
@@ -151,14 +384,30 @@ public:
     void stop()
     {
         ioc.stop();
+        for(auto& context: core_iocs) context->stop();
     }
 
 private:
 
+    template<class F>
+    static detail::HttpHandler make_http_handler(F&& f)
+    {
+        if constexpr (std::is_invocable_v<F&, Request&&, const PathParams&>)
+        {
+            return detail::HttpHandler(
+                [f=std::move(f)] (auto&& r, const PathParams& p) {return detail::make_response(f(std::move(r), p));});
+        }
+        else
+        {
+            return detail::HttpHandler(
+                [f=std::move(f)] (auto&& r, const PathParams&) {return detail::make_response(f(std::move(r)));});
+        }
+    }
+
     // Returns a not found response
-    auto not_found(http::request<http::string_body>& req)
+    auto not_found(Request& req)
     {
-        http::response<http::string_body> res{http::status::not_found, req.version()};
+        Response res{http::status::not_found, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, "text/html");
         res.keep_alive(req.keep_alive());
@@ -167,87 +416,720 @@ private:
         return res;
     };
 
-    // Returns an error response
-    auto exception_response(http::request<http::string_body>& req, const HttpException& e)
+    // Returns a method not allowed response
+    auto method_not_allowed(Request& req, std::uint64_t allowed)
     {
-        http::response<http::string_body> res{e.code(), req.version()};
+        Response res{http::status::method_not_allowed, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, "text/html");
+        res.set(http::field::allow, detail::Registry::allow_header(allowed));
         res.keep_alive(req.keep_alive());
+        res.body() = "The method '" + std::string(http::to_string(req.method())) + "' is not allowed.";
+        res.prepare_payload();
+        return res;
+    }
+
+    // Returns the answer to an OPTIONS request no handler was registered for
+    auto options_response(Request& req, std::uint64_t allowed)
+    {
+        Response res{http::status::no_content, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::allow, detail::Registry::allow_header(allowed));
+        res.keep_alive(req.keep_alive());
+        return res;
+    }
+
+    // Returns an error response
+    static Response exception_response(unsigned version, bool keep_alive, const HttpException& e)
+    {
+        Response res{e.code(), version};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::content_type, "text/html");
+        res.keep_alive(keep_alive);
         res.body() = e.what();
         res.prepare_payload();
         return res;
     };
 
+    // Runs an HTTP handler, turning what it throws into an error response
+    Response invoke(
+        const detail::HttpHandler& handler,
+        Request&& req,
+        const PathParams& params)
+    {
+        auto const version = req.version();
+        auto const keep_alive = req.keep_alive();
+        try {
+            return handler(std::move(req), params);
+        } catch (const HttpException& e) {
+            return exception_response(version, keep_alive, e);
+        } catch (const std::exception& e) {
+            return exception_response(version, keep_alive,
+                HttpException(http::status::internal_server_error, e.what()));
+        } catch (...) {
+            return exception_response(version, keep_alive,
+                HttpException(http::status::internal_server_error, "unhandled exception"));
+        }
+    }
+
+    // Completion of an asynchronous handler: resumes the session waiting
+    // for the response on the session's executor.
+    template<class Handler>
+    class AsyncCompletion: public detail::ResponderState
+    {
+    public:
+        AsyncCompletion(Handler handler, unsigned version, bool keep_alive)
+            : handler_(std::move(handler)), version_(version), keep_alive_(keep_alive)
+        {
+        }
+
+        ~AsyncCompletion() override
+        {
+            if(!done_.load())
+                complete(exception_response(version_, keep_alive_,
+                    HttpException(http::status::internal_server_error, "The handler did not respond.")));
+        }
+
+        void complete(Response&& response) override
+        {
+            if(done_.exchange(true))
+                return;
+            auto executor = boost::asio::get_associated_executor(handler_);
+            boost::asio::post(executor,
+                [handler = std::move(handler_), response = std::move(response)]() mutable {
+                    handler(boost::system::error_code(), std::move(response));
+                });
+        }
+
+    private:
+        Handler handler_;
+        unsigned version_;
+        bool keep_alive_;
+        std::atomic<bool> done_{false};
+    };
+
+    // Runs an asynchronous HTTP handler; the session resumes with the
+    // response it gives, or with the error response for what it throws.
+    template<class Token>
+    auto invoke_async(
+        const detail::AsyncHttpHandler& handler,
+        Request&& req,
+        const PathParams& params,
+        detail::Arena& arena,
+        Token&& token)
+    {
+        return boost::asio::async_initiate<Token, void(boost::system::error_code, Response)>(
+            [&handler, &req, &params, &arena](auto completion) {
+                auto const version = req.version();
+                auto const keep_alive = req.keep_alive();
+                Responder respond(std::make_shared<AsyncCompletion<decltype(completion)>>(
+                    std::move(completion), version, keep_alive));
+                detail::Arena::Scope scope(arena);
+                try {
+                    handler(std::move(req), params, respond);
+                } catch (const HttpException& e) {
+                    respond(exception_response(version, keep_alive, e));
+                } catch (const std::exception& e) {
+                    respond(exception_response(version, keep_alive,
+                        HttpException(http::status::internal_server_error, e.what())));
+                } catch (...) {
+                    respond(exception_response(version, keep_alive,
+                        HttpException(http::status::internal_server_error, "unhandled exception")));
+                }
+            }, token);
+    }
+
     void fail(boost::system::error_code ec, char const* what)
     {
+        metrics_.local().error(what);
         std::cerr << what << ": " << ec.message() << std::endl;
     }
 
+    // Failures caused by `deadline` expiring count as timeouts
+    void fail(const detail::Deadline& deadline, boost::system::error_code ec, char const* what)
+    {
+        if(deadline.expired())
+            fail(boost::asio::error::timed_out, "timeout");
+        else
+            fail(ec, what);
+    }
+
+    // Responses to HEAD requests are written without their body, keeping
+    // the Content-Length of the GET response. Writes are given the write
+    // timeout, restarted whenever some of the response went out.
+    template<class StreamClass, class Body, class Fields>
+    detail::Task write(
+        StreamClass& stream,
+        http::response<Body, Fields>& response,
+        bool head_only,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        http::serializer<false, Body, Fields> sr{response};
+        deadline.expires_after(timeouts_.write);
+        if(head_only)
+        {
+            CRITTER_AWAIT http::async_write_header(stream, sr, yield[ec]);
+        }
+        else
+        {
+            while(!ec && !sr.is_done())
+            {
+                CRITTER_AWAIT http::async_write_some(stream, sr, yield[ec]);
+                deadline.restart();
+            }
+        }
+        deadline.cancel();
+    }
+
+    template<class StreamClass>
+    detail::Task write(
+        StreamClass& stream,
+        detail::CachedResponse& response,
+        bool head_only,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        auto buffers = response.buffers();
+        if(head_only)
+            buffers.back() = boost::asio::const_buffer();
+        deadline.expires_after(timeouts_.write);
+        CRITTER_AWAIT boost::asio::async_write(stream, buffers, yield[ec]);
+        deadline.cancel();
+    }
+
+#if defined(__linux__)
+    // Plain TCP sessions hand file bodies to the kernel with sendfile(2).
+    detail::Task write(
+        tcp::socket& stream,
+        detail::FileBodyResponse& response,
+        bool head_only,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        http::serializer<false, detail::FileBody, detail::FileBodyResponse::fields_type> sr{response};
+        deadline.expires_after(timeouts_.write);
+        CRITTER_AWAIT http::async_write_header(stream, sr, yield[ec]);
+        if(!ec && !head_only)
+            CRITTER_AWAIT detail::send_file_body(stream, response.body(), deadline, yield, ec);
+        deadline.cancel();
+    }
+#endif
+
+    using RequestParser = http::request_parser<Request::body_type, MessageAllocator>;
+
+    // Largest body buffered for the routes that are not streaming
+    static constexpr std::uint64_t max_body_size = 1024 * 1024;
+
+    // Feeds the body of a request to a streaming handler as it is read, in
+    // chunks taken from the arena, then builds the response. Clears
+    // `keep_alive` when the rest of the body is left unread, and counts the
+    // bytes fed in `body_bytes`. Each chunk is given the read body timeout.
     template<class StreamClass>
-    void do_session(
+    detail::Task stream_request(
         StreamClass& stream,
-        boost::asio::yield_context yield)
+        boost::beast::flat_buffer& buffer,
+        RequestParser& parser,
+        const detail::StreamingHandler& handler,
+        const PathParams& params,
+        detail::Arena& arena,
+        Response& response,
+        bool& keep_alive,
+        std::uint64_t& body_bytes,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        auto const version = parser.get().version();
+        auto const fail_with = [&](http::status status, const std::string& what) {
+            response = exception_response(version, keep_alive, HttpException(status, what));
+        };
+        // Runs a handler callback, turning what it throws into the response
+        auto const call = [&](auto&& f) {
+            detail::Arena::Scope scope(arena);
+            try {
+                f();
+                return true;
+            } catch (const HttpException& e) {
+                response = exception_response(version, keep_alive, e);
+            } catch (const std::exception& e) {
+                fail_with(http::status::internal_server_error, e.what());
+            } catch (...) {
+                fail_with(http::status::internal_server_error, "unhandled exception");
+            }
+            return false;
+        };
+
+        auto const length = parser.content_length();
+        if(length && *length > handler.body_limit)
+        {
+            keep_alive = keep_alive && parser.is_done();
+            fail_with(http::status::payload_too_large, "The request body is too large.");
+            CRITTER_CO_RETURN;
+        }
+
+        std::optional<BodyConsumer> consumer;
+        if(!call([&] { consumer.emplace(handler.open(parser.get(), params)); }))
+        {
+            keep_alive = keep_alive && parser.is_done();
+            CRITTER_CO_RETURN;
+        }
+
+        if(parser.is_done())
+        {
+            // Pipelined along with an earlier request, and already read
+            auto const& body = parser.get().body();
+            if(body.size() > handler.body_limit)
+            {
+                fail_with(http::status::payload_too_large, "The request body is too large.");
+                CRITTER_CO_RETURN;
+            }
+            body_bytes += body.size();
+            if(!call([&] { consumer->data(std::string_view(body.data(), body.size())); }))
+                CRITTER_CO_RETURN;
+        }
+        else
+        {
+            if(boost::beast::iequals(parser.get()[http::field::expect], "100-continue"))
+            {
+                static const std::string continue_11 = "HTTP/1.1 100 Continue\r\n\r\n";
+                deadline.expires_after(timeouts_.write);
+                CRITTER_AWAIT boost::asio::async_write(stream, boost::asio::buffer(continue_11), yield[ec]);
+                deadline.cancel();
+                if(ec) CRITTER_CO_RETURN;
+            }
+
+            http::request_parser<http::buffer_body, MessageAllocator> body_parser{std::move(parser)};
+            body_parser.body_limit(handler.body_limit);
+            auto const chunk = static_cast<char*>(arena.allocate(detail::FILE_BUFFER_SIZE, 1));
+            while(!body_parser.is_done())
+            {
+                body_parser.get().body().data = chunk;
+                body_parser.get().body().size = detail::FILE_BUFFER_SIZE;
+                deadline.expires_after(timeouts_.read_body);
+                CRITTER_AWAIT http::async_read(stream, buffer, body_parser, yield[ec]);
+                deadline.cancel();
+                if(ec == http::error::need_buffer)
+                    ec = {};
+                if(ec == http::error::body_limit)
+                {
+                    ec = {};
+                    keep_alive = false;
+                    fail_with(http::status::payload_too_large, "The request body is too large.");
+                    CRITTER_CO_RETURN;
+                }
+                if(ec) CRITTER_CO_RETURN;
+
+                auto const size = detail::FILE_BUFFER_SIZE - body_parser.get().body().size;
+                body_bytes += size;
+                if(!call([&] { consumer->data(std::string_view(chunk, size)); }))
+                {
+                    keep_alive = keep_alive && body_parser.is_done();
+                    CRITTER_CO_RETURN;
+                }
+            }
+        }
+
+        call([&] { response = consumer->done(); });
+    }
+
+    // Runs a handler streaming its response, then sends the header and the
+    // chunks written to the ResponseWriter as they come, counting them in
+    // `body_bytes`. Sets `sent`, and the status of `response`, unless the
+    // handler threw: `response` is then the error response to send.
+    template<class StreamClass>
+    detail::Task stream_response(
+        StreamClass& stream,
+        const detail::ChunkedHttpHandler& handler,
+        Request&& req,
+        const PathParams& params,
+        detail::Arena& arena,
+        bool head_only,
+        Response& response,
+        bool& sent,
+        bool& keep_alive,
+        std::uint64_t& body_bytes,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        auto const version = req.version();
+        auto const chunked = version >= 11;
+        std::shared_ptr<detail::ResponseWriterState> state;
+        {
+            detail::Arena::Scope scope(arena);
+            Response header{http::status::ok, version};
+            header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            header.set(http::field::content_type, "text/plain");
+            header.keep_alive(keep_alive);
+            state = std::make_shared<detail::ResponseWriterState>(stream.get_executor(), std::move(header));
+            try {
+                handler(std::move(req), params, ResponseWriter(state));
+                sent = true;
+            } catch (const HttpException& e) {
+                response = exception_response(version, keep_alive, e);
+            } catch (const std::exception& e) {
+                response = exception_response(version, keep_alive,
+                    HttpException(http::status::internal_server_error, e.what()));
+            } catch (...) {
+                response = exception_response(version, keep_alive,
+                    HttpException(http::status::internal_server_error, "unhandled exception"));
+            }
+        }
+        if(!sent)
+        {
+            state->abort(boost::asio::error::operation_aborted);
+            CRITTER_CO_RETURN;
+        }
+
+        // HTTP/1.0 clients get the body up to the end of the connection
+        auto header = std::move(state->header());
+        if(chunked)
+            header.chunked(true);
+        else
+            header.keep_alive(false);
+        keep_alive = keep_alive && header.keep_alive();
+        response.result(header.result());
+        CRITTER_AWAIT write(stream, header, true, deadline, yield, ec);
+        if(ec || head_only)
+        {
+            state->abort(ec ? ec : boost::asio::error::operation_aborted);
+            CRITTER_CO_RETURN;
+        }
+
+        for(;;)
+        {
+            auto data = CRITTER_AWAIT state->async_next(yield[ec]);
+            if(ec == boost::asio::error::eof)
+                break;
+            // An empty chunk would end the body
+            deadline.expires_after(timeouts_.write);
+            if(!data.empty() && chunked)
+                CRITTER_AWAIT boost::asio::async_write(stream, http::make_chunk(boost::asio::buffer(data)), yield[ec]);
+            else if(!data.empty())
+                CRITTER_AWAIT boost::asio::async_write(stream, boost::asio::buffer(data), yield[ec]);
+            deadline.cancel();
+            state->written(ec);
+            body_bytes += data.size();
+            if(ec)
+            {
+                state->abort(ec);
+                CRITTER_CO_RETURN;
+            }
+        }
+        ec = {};
+        if(chunked)
+        {
+            deadline.expires_after(timeouts_.write);
+            CRITTER_AWAIT boost::asio::async_write(stream, http::make_chunk_last(), yield[ec]);
+            deadline.cancel();
+        }
+    }
+
+    // Subscribes to `channel` and writes its events, each time every event
+    // published since the last write, until the subscription or the
+    // connection ends. The body is delimited by the end of the connection.
+    template<class StreamClass>
+    detail::Task stream_events(
+        StreamClass& stream,
+        EventChannel& channel,
+        unsigned version,
+        bool head_only,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        http::response<http::empty_body> header{http::status::ok, version};
+        header.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        header.set(http::field::content_type, "text/event-stream");
+        header.set(http::field::cache_control, "no-cache");
+        header.keep_alive(false);
+        CRITTER_AWAIT write(stream, header, true, deadline, yield, ec);
+        if(ec || head_only)
+            CRITTER_CO_RETURN;
+
+        auto subscriber = channel.subscribe(stream.get_executor());
+        detail::Metrics::GaugeScope subscribed(metrics_, &detail::MetricsShard::sse_sessions);
+        std::vector<boost::asio::const_buffer> buffers;
+        for(;;)
+        {
+            auto events = CRITTER_AWAIT subscriber->async_next(yield[ec]);
+            if(ec == boost::asio::error::eof)
+            {
+                ec = {};
+                break;
+            }
+            buffers.clear();
+            for(auto& event: events)
+                buffers.push_back(boost::asio::buffer(*event));
+            deadline.expires_after(timeouts_.write);
+            CRITTER_AWAIT boost::asio::async_write(stream, buffers, yield[ec]);
+            deadline.cancel();
+            if(ec)
+                break;
+        }
+    }
+
+    // Responses to pipelined requests go out in a single gathered write
+    template<class StreamClass>
+    detail::Task write_batch(
+        StreamClass& stream,
+        detail::ResponseBatch& batch,
+        detail::Deadline& deadline,
+        detail::Yield yield,
+        boost::system::error_code& ec)
+    {
+        if(!batch.empty())
+        {
+            deadline.expires_after(timeouts_.write);
+            CRITTER_AWAIT boost::asio::async_write(stream, batch.buffers(), yield[ec]);
+            deadline.cancel();
+        }
+        batch.clear();
+    }
+
+    template<class StreamClass>
+    detail::Task do_session(
+        StreamClass& stream,
+        detail::Yield yield)
     {
         boost::system::error_code ec;
         boost::beast::flat_buffer buffer;
+        detail::Arena arena;
+        detail::ResponseBatch batch;
+        metrics_.local().connections.add(1);
+        detail::Metrics::GaugeScope active(metrics_, &detail::MetricsShard::http_sessions);
+
+        // Armed around each operation; expiring closes the socket, which
+        // fails the operation
+        detail::Deadline deadline(detail::timer_wheel(stream.get_executor()), [&stream] {
+            boost::system::error_code ec;
+            boost::beast::get_lowest_layer(stream).close(ec);
+        });
 
         if constexpr (std::is_same_v<StreamClass, boost::beast::ssl_stream<tcp::socket>>)
         {
             // Perform the SSL handshake
-            stream.async_handshake(ssl::stream_base::server, yield[ec]);
+            deadline.expires_after(timeouts_.read_header);
+            CRITTER_AWAIT stream.async_handshake(ssl::stream_base::server, yield[ec]);
+            deadline.cancel();
             if(ec)
-                return fail(ec, "handshake");
+                CRITTER_CO_RETURN fail(deadline, ec, "handshake");
         }
 
-        for(;;)
+        for(bool first = true;; first = false)
         {
-            // Read a request
-            http::request<http::string_body> req;
-            http::async_read(stream, buffer, req, yield[ec]);
+            // Whatever the previous exchanges allocated is gone by now
+            arena.reset();
+
+            // Wait for the next request of a kept-alive connection, which
+            // is closed quietly if none comes in time
+            if(!first && buffer.size() == 0)
+            {
+                deadline.expires_after(timeouts_.idle);
+                auto const n = CRITTER_AWAIT stream.async_read_some(
+                    buffer.prepare(boost::beast::read_size(buffer, 65536)), yield[ec]);
+                deadline.cancel();
+                if(deadline.expired())
+                    CRITTER_CO_RETURN;
+                if(ec == boost::asio::error::eof)
+                    break;
+                if(ec)
+                    CRITTER_CO_RETURN fail(ec, "read");
+                buffer.commit(n);
+            }
+
+            // Read a request header; the body is read once it is routed
+            auto const alloc = detail::allocator_for<MessageAllocator>(arena);
+            std::optional<RequestParser> parser;
+            auto const next_parser = [&] {
+                parser.emplace(std::piecewise_construct, std::make_tuple(alloc), std::make_tuple(alloc));
+                // The limit depends on the route, which is known once the
+                // header is parsed
+                parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+            };
+            next_parser();
+            deadline.expires_after(timeouts_.read_header);
+            CRITTER_AWAIT http::async_read_header(stream, buffer, *parser, yield[ec]);
+            deadline.cancel();
             if(ec == http::error::end_of_stream)
                 break;
             if(ec)
-                return fail(ec, "read");
+                CRITTER_CO_RETURN fail(deadline, ec, "read");
 
-            http::response<http::string_body> response;
-            try
+            // Answer it, then the requests pipelined behind it that came
+            // along in the same reads
+            bool keep_alive;
+            do
             {
-                auto handler = registry_.get(req.method(), req.target());
-                if(websocket::is_upgrade(req))
+                auto const started = std::chrono::steady_clock::now();
+                std::uint64_t request_bytes = 0;
+                std::uint64_t response_bytes = 0;
+                PathParams params;
+                auto handler = registry_.find(parser->get().method(), parser->get().target(), params);
+                detail::FileResponse response;
+                bool sent = false;
+                auto const head_only = parser->get().method() == http::verb::head;
+                keep_alive = parser->get().keep_alive();
+
+                auto streaming = handler ? std::get_if<detail::StreamingHandler>(handler) : nullptr;
+                if(!streaming)
                 {
-                    auto session = std::make_shared<detail::WebSocketSessionImpl<StreamClass>>(std::move(stream),
-                            std::get<detail::WebSocketHandler>(handler));
-                    this->add(session);
-                    session->on_close([this](auto session) {
-                        this->remove(session);
-                    });
-                    session->run(std::move(req), yield);
-                    return;
+                    auto const length = parser->content_length();
+                    if((length && *length > max_body_size) || parser->get().body().size() > max_body_size)
+                        CRITTER_CO_RETURN fail(http::error::body_limit, "read");
+                    if(!parser->is_done())
+                    {
+                        parser->body_limit(max_body_size);
+                        deadline.expires_after(timeouts_.read_body);
+                        CRITTER_AWAIT http::async_read(stream, buffer, *parser, yield[ec]);
+                        deadline.cancel();
+                        if(ec)
+                            CRITTER_CO_RETURN fail(deadline, ec, "read");
+                    }
                 }
-                else
+                Request req = streaming ? Request() : parser->release();
+                request_bytes += req.body().size();
+
+                // Responses built until the writes below come from the arena too
+                std::optional<detail::Arena::Scope> scope(std::in_place, arena);
+                if(streaming)
+                {
+                    scope.reset();
+                    response.template emplace<Response>();
+                    CRITTER_AWAIT stream_request(stream, buffer, *parser, *streaming, params, arena,
+                        std::get<Response>(response), keep_alive, request_bytes, deadline, yield, ec);
+                    if(ec)
+                        CRITTER_CO_RETURN fail(deadline, ec, "read");
+                }
+                else if(!handler)
+                {
+                    auto const allowed = registry_.allowed_verbs(req.target());
+                    if(!allowed)
+                        response = not_found(req);
+                    else if(req.method() == http::verb::options)
+                        response = options_response(req, allowed);
+                    else
+                        response = method_not_allowed(req, allowed);
+                }
+                else if(auto ws_handler = std::get_if<detail::WebSocketHandler>(handler))
                 {
-                    try {
-                        response = std::get<detail::HttpHandler>(handler)(std::move(req));
-                    } catch (const HttpException&) {
-                        throw;
-                    } catch (const std::exception& e) {
-                        throw HttpException(http::status::internal_server_error, e.what());
-                    } catch (...) {
-                        throw HttpException(http::status::internal_server_error, "unhandled exception");
+                    if(!websocket::is_upgrade(req))
+                    {
+                        response = not_found(req);
+                    }
+                    else
+                    {
+                        scope.reset();
+                        CRITTER_AWAIT write_batch(stream, batch, deadline, yield, ec);
+                        if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+
+                        auto session = std::make_shared<detail::WebSocketSessionImpl<StreamClass>>(std::move(stream),
+                                *ws_handler, ws_options_, spawn_, req.target(), params);
+                        this->add(session);
+                        session->on_close([this](auto session) {
+                            this->remove(session);
+                        });
+                        session->run(detail::detach(std::move(req)));
+                        CRITTER_CO_RETURN;
                     }
                 }
-            } catch(const detail::Registry::NotFound&) {
-                response = not_found(req);
-            } catch(const HttpException& e) {
-                response = exception_response(req, e);
+                else if(auto files = std::get_if<detail::FileHandler>(handler))
+                {
+                    response = (*files)(std::move(req));
+                }
+                else if(auto chunked = std::get_if<detail::ChunkedHttpHandler>(handler))
+                {
+                    // The streamed response follows the queued ones
+                    scope.reset();
+                    CRITTER_AWAIT write_batch(stream, batch, deadline, yield, ec);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                    response.template emplace<Response>();
+                    CRITTER_AWAIT stream_response(stream, *chunked, std::move(req), params, arena, head_only,
+                        std::get<Response>(response), sent, keep_alive, response_bytes, deadline, yield, ec);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                }
+                else if(auto sse = std::get_if<detail::SseHandler>(handler))
+                {
+                    // The event stream follows the queued responses, and
+                    // keeps the connection
+                    scope.reset();
+                    CRITTER_AWAIT write_batch(stream, batch, deadline, yield, ec);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                    CRITTER_AWAIT stream_events(stream, *sse->channel, req.version(), head_only, deadline, yield, ec);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                    sent = true;
+                    keep_alive = false;
+                }
+                else if(auto async = std::get_if<detail::AsyncHttpHandler>(handler))
+                {
+                    // Send what is queued while the handler works
+                    scope.reset();
+                    CRITTER_AWAIT write_batch(stream, batch, deadline, yield, ec);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                    response = CRITTER_AWAIT invoke_async(*async, std::move(req), params, arena, yield[ec]);
+                }
+                else
+                {
+                    response = invoke(std::get<detail::HttpHandler>(*handler), std::move(req), params);
+                }
+                scope.reset();
+
+                if(!sent && !head_only)
+                    response_bytes = std::visit([](auto& res) -> std::uint64_t {
+                        if constexpr (std::is_same_v<std::decay_t<decltype(res)>, detail::CachedResponse>)
+                            return res.buffers().back().size();
+                        else
+                            return res.body().size();
+                    }, response);
+                auto const status = std::visit([](auto& res) -> unsigned {
+                    if constexpr (std::is_same_v<std::decay_t<decltype(res)>, detail::CachedResponse>)
+                        return 200;
+                    else
+                        return res.result_int();
+                }, response);
+
+                // Queue the response, or send it after the queued ones when
+                // it is streamed
+                if(!sent)
+                    keep_alive = keep_alive && std::visit([](auto& res) { return res.keep_alive(); }, response);
+                auto const batched = !sent && std::visit([&](auto& res) {
+                    if constexpr (std::is_same_v<std::decay_t<decltype(res)>, detail::FileBodyResponse>)
+                        return false;
+                    else if(!detail::ResponseBatch::accepts(res))
+                        return false;
+                    else
+                        return batch.add(std::move(res), head_only), true;
+                }, response);
+                if(!sent && !batched)
+                {
+                    CRITTER_AWAIT write_batch(stream, batch, deadline, yield, ec);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                    CRITTER_AWAIT std::visit([&](auto& res) { return write(stream, res, head_only, deadline, yield, ec); }, response);
+                    if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+                }
+
+                // Event streams only count as sessions
+                if(!handler || !std::holds_alternative<detail::SseHandler>(*handler))
+                {
+                    auto const elapsed = std::chrono::steady_clock::now() - started;
+                    metrics_.local().record(handler ? registry_.index(*handler) + 1 : 0, status,
+                        request_bytes, response_bytes,
+                        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+                }
+
+                next_parser();
             }
+            while(keep_alive && batch.size() < detail::ResponseBatch::max_size &&
+                  detail::parse_buffered(buffer, *parser));
 
-            // Send the response
-            http::serializer<false, http::string_body> sr{response};
-            http::async_write(stream, sr, yield[ec]);
-            if(ec) return fail(ec, "write");
-            if(!response.keep_alive())
+            // Send the queued responses
+            CRITTER_AWAIT write_batch(stream, batch, deadline, yield, ec);
+            if(ec) CRITTER_CO_RETURN fail(deadline, ec, "write");
+            if(!keep_alive)
             {
                 // This means we should close the connection, usually because
                 // the response indicated the "Connection: close" semantic.
@@ -257,9 +1139,11 @@ private:
 
         if constexpr (std::is_same_v<StreamClass, boost::beast::ssl_stream<tcp::socket>>)
         {
-            stream.async_shutdown(yield[ec]);
+            deadline.expires_after(timeouts_.write);
+            CRITTER_AWAIT stream.async_shutdown(yield[ec]);
+            deadline.cancel();
             if(ec)
-                return fail(ec, "shutdown");
+                CRITTER_CO_RETURN fail(deadline, ec, "shutdown");
         }
         else
         {
@@ -268,10 +1152,11 @@ private:
     }
 
     template<class StreamClass>
-    void do_listen(
+    detail::Task do_listen(
         boost::asio::io_context& ioc,
         tcp::endpoint endpoint,
-        boost::asio::yield_context yield)
+        bool reuse_port,
+        detail::Yield yield)
     {
         boost::system::error_code ec;
 
@@ -282,6 +1167,13 @@ private:
             throw boost::system::system_error(ec);
 
         acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+        if(reuse_port)
+            acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+        if(reuse_port)
+            throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
 
         // Bind to the server address
         acceptor.bind(endpoint, ec);
@@ -296,50 +1188,80 @@ private:
         for(;;)
         {
             tcp::socket socket(ioc);
-            acceptor.async_accept(socket, yield[ec]);
+            CRITTER_AWAIT acceptor.async_accept(socket, yield[ec]);
             if(ec)
                 fail(ec, "accept");
             else {
                 if constexpr (std::is_same_v<StreamClass, boost::beast::ssl_stream<tcp::socket>>) {
-                    boost::asio::spawn(
-                        acceptor.get_executor(),
-                        std::bind(
-                            &WebServer::do_session<boost::beast::ssl_stream<tcp::socket>>, this,
-                            boost::beast::ssl_stream<tcp::socket>(std::move(socket), ctx),
-                            std::placeholders::_1));
+                    spawn_(acceptor.get_executor(),
+                        [this, stream = StreamClass(std::move(socket), ctx)](auto yield) mutable {
+                            return do_session(stream, yield);
+                        });
                 }
                 else
                 {
-                    boost::asio::spawn(
-                        acceptor.get_executor(),
-                        std::bind(
-                            &WebServer::do_session<tcp::socket>, this,
-                            tcp::socket(std::move(socket)),
-                            std::placeholders::_1));
+                    spawn_(acceptor.get_executor(),
+                        [this, stream = std::move(socket)](auto yield) mutable {
+                            return do_session(stream, yield);
+                        });
                 }
             }
         }
     }
 
+    struct Listener
+    {
+        tcp::endpoint endpoint;
+        bool ssl;
+    };
+
+    void spawn_listener(boost::asio::io_context& context, const Listener& listener, bool reuse_port)
+    {
+        if(listener.ssl)
+        {
+            spawn_(context.get_executor(),
+                [this, &context, endpoint = listener.endpoint, reuse_port](auto yield) {
+                    return do_listen<boost::beast::ssl_stream<tcp::socket>>(context, endpoint, reuse_port, yield);
+                });
+        }
+        else
+        {
+            spawn_(context.get_executor(),
+                [this, &context, endpoint = listener.endpoint, reuse_port](auto yield) {
+                    return do_listen<tcp::socket>(context, endpoint, reuse_port, yield);
+                });
+        }
+    }
+
     void add(std::shared_ptr<detail::WebSocketSession> session)
     {
+        metrics_.local().websocket_sessions.add(1);
         std::lock_guard<std::mutex> lock(mutex_);
         ws_sessions_.push_back(std::move(session));
     }
 
     void remove(const std::shared_ptr<detail::WebSocketSession>& session)
     {
+        metrics_.local().websocket_sessions.add(-1);
         std::lock_guard<std::mutex> lock(mutex_);
         ws_sessions_.erase(std::remove(ws_sessions_.begin(), ws_sessions_.end(), session),
                            ws_sessions_.end());
     }
 
+    // Outlives the sessions, which record to it until they are destroyed
+    detail::Metrics metrics_;
     boost::asio::io_context ioc;
+    std::vector<std::unique_ptr<boost::asio::io_context>> core_iocs;
     ssl::context ctx{ssl::context::tlsv12};
     std::vector<std::thread> threads;
+    std::vector<Listener> listeners_;
     detail::Registry registry_;
     mutable std::mutex mutex_;
     WebSocketSessions ws_sessions_;
+    WebSocketOptions ws_options_;
+    TimeoutOptions timeouts_;
+    detail::Spawner spawn_;
+    std::unique_ptr<detail::WorkerPool> workers_;
 };
 
 }